@@ -9,15 +9,18 @@
 #ifndef BOGUSCF_H
 #define BOGUSCF_H
 
+#include "Transform/obf_utilities.h"
 #include "llvm/Pass.h"
 #include "llvm/PassManager.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
 #include <random>
+#include <vector>
 
 using namespace llvm;
 
 struct BogusCF : public FunctionPass {
   static char ID;
-  std::mt19937_64 engine;
+  ObfUtils::RandomEngine engine;
   std::bernoulli_distribution trial;
 
   BogusCF() : FunctionPass(ID) {}
@@ -25,8 +28,17 @@ struct BogusCF : public FunctionPass {
   // Initialise and check options
   virtual bool doInitialization(Module &M);
   virtual bool runOnFunction(Function &F);
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const;
 
-  // Check to see if a function is eligible for bogus CF processing
-  static bool isEligible(Function &F);
+private:
+  // Synthesise size junk blocks at the end of F to serve as the never taken
+  // successors of opaque predicates. They compute on the arguments and a
+  // volatile load of a private global, so that they cannot be folded away
+  std::vector<BasicBlock *> createDecoys(Function &F, unsigned size);
+
+  // Join the values of originalBlock and its clone copyBlock with PHI nodes
+  // in successor, their common successor. Nothing is demoted
+  static void mergeSSA(BasicBlock *originalBlock, BasicBlock *copyBlock,
+                       BasicBlock *successor, ValueToValueMapTy &VMap);
 };
 #endif
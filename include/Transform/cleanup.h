@@ -17,6 +17,7 @@ struct CleanupPass : public FunctionPass {
 
   CleanupPass() : FunctionPass(ID) {}
   virtual bool runOnFunction(Function &F);
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const;
 };
 
 #endif
@@ -16,12 +16,13 @@ using namespace llvm;
 
 struct Copy : public ModulePass {
   static char ID;
-  std::mt19937_64 engine;
+  ObfUtils::RandomEngine engine;
   std::bernoulli_distribution trial;
   std::bernoulli_distribution trialReplace;
 
   Copy() : ModulePass(ID) {}
   virtual bool runOnModule(Module &M);
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const;
 
   // Tag this function as "must obfuscate of type"
   static void tagFunction(Function &F, ObfUtils::ObfType type);
@@ -9,27 +9,77 @@
 #ifndef FLATTEN_H
 #define FLATTEN_H
 
+#include "Transform/obf_utilities.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/Pass.h"
 #include "llvm/PassManager.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Value.h"
 #include <random>
+#include <vector>
 
 using namespace llvm;
 
 struct Flatten : public FunctionPass {
+  // How the jump block transfers control to the next block
+  enum DispatchStrategy {
+    // Load the address from a jump table and branch indirectly
+    TableDispatch,
+    // Switch on the state value. Keeps the function inlinable
+    SwitchDispatch,
+    // The state is the block address itself
+    DirectDispatch,
+    // Like TableDispatch, but the read-only table holds 32 bit offsets from
+    // the first target so that it needs no dynamic relocations
+    RelativeDispatch
+  };
+
+  // A jump block, its state PHI node and the blocks it dispatches to. The
+  // state selects a block by its position in targets
+  struct Dispatcher {
+    BasicBlock *block;
+    PHINode *index;
+    std::vector<BasicBlock *> targets;
+  };
+
   static char ID;
-  std::mt19937_64 engine;
+  ObfUtils::RandomEngine engine;
   std::bernoulli_distribution trial;
   StringRef metaKindName;
 
   Flatten() : FunctionPass(ID), metaKindName("FlattenSwitch") {}
 
+  // Returns the state value that dispatches to block. indices maps every
+  // flattened block to its position in the targets of its dispatcher
   inline Value *findBlock(LLVMContext &context,
-                          std::vector<BasicBlock *> &blocks, BasicBlock *block);
+                          DenseMap<BasicBlock *, unsigned> &indices,
+                          BasicBlock *block);
   virtual bool doInitialization(Module &M);
   virtual bool runOnFunction(Function &F);
-  static bool isEligible(Function &F);
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const;
+
+private:
+  // Create a jump block in front of insertBefore that dispatches to targets
+  static Dispatcher createDispatcher(Function &F,
+                                     std::vector<BasicBlock *> &targets,
+                                     BasicBlock *insertBefore);
+
+  // Demote every value that is used outside of its defining block, except
+  // for values from the entry block, in a single pass over the function
+  static void demoteCrossBlockValues(Function &F);
+
+  // Replicate the dispatch sequence of jumpBlock at the end of every block
+  // that unconditionally branches to it, so that each block gets its own
+  // indirect branch. Cross block values must have been demoted
+  static void threadDispatch(BasicBlock *jumpBlock, PHINode *jumpIndex,
+                             std::vector<BasicBlock *> &blocks);
+
+  // Rebuild SSA form after the CFG has been flattened without demotion.
+  // phis are the PHI nodes of flattened blocks, detached from their blocks
+  // before the CFG changed. Values are rejoined with PHI nodes where they meet,
+  // mostly in the jump block
+  static void repairSSA(Function &F,
+                        std::vector<std::pair<PHINode *, BasicBlock *> > &phis);
 };
 
 #endif
@@ -17,6 +17,7 @@ struct IdentifierRenamer : public ModulePass {
 
   IdentifierRenamer() : ModulePass(ID) {}
   virtual bool runOnModule(Module &M);
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const;
 };
 
 #endif
@@ -9,6 +9,7 @@
 #ifndef INLINE_FUNCTION_H
 #define INLINE_FUNCTION_H
 
+#include "Transform/obf_utilities.h"
 #include "llvm/Pass.h"
 #include "llvm/PassManager.h"
 #include <random>
@@ -17,7 +18,7 @@ using namespace llvm;
 
 struct InlineFunctionPass : public FunctionPass {
   static char ID;
-  std::mt19937_64 engine;
+  ObfUtils::RandomEngine engine;
   std::bernoulli_distribution trial;
 
   InlineFunctionPass() : FunctionPass(ID) {}
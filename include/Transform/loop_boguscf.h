@@ -8,17 +8,61 @@
 //===----------------------------------------------------------------------===//
 #ifndef LOOP_BOGUSCF_H
 #define LOOP_BOGUSCF_H
+#include "Transform/obf_utilities.h"
 #include "llvm/Analysis/LoopPass.h"
+#include "llvm/Analysis/ScalarEvolution.h"
 #include "llvm/Pass.h"
 #include "llvm/PassManager.h"
+#include "llvm/IR/Instructions.h"
+#include <memory>
+#include <random>
 using namespace llvm;
 
 struct LoopBogusCF : public LoopPass {
+  // Where the opaque predicate of a loop is evaluated
+  enum Placement {
+    // In the header, on every iteration
+    HeaderPlacement,
+    // In front of the loop, once every time the loop is entered
+    PreheaderPlacement,
+    // In the header of outermost loops only. Nested loops are skipped
+    OuterPlacement,
+    // In the header, on every -loopBcfStride th iteration
+    StridedPlacement,
+    // Chosen from the trip count and the depth of the loop
+    AutoPlacement
+  };
+
   static char ID;
+  ObfUtils::RandomEngine engine;
+  // Function the engine has been seeded for
+  Function *engineFunction;
+  // Block hotness of the function whose loops are being visited
+  std::unique_ptr<ObfUtils::HotnessFilter> hotness;
+  Function *hotnessFunction;
 
-  LoopBogusCF() : LoopPass(ID) {}
+  LoopBogusCF()
+      : LoopPass(ID), engineFunction(nullptr), hotnessFunction(nullptr) {}
   virtual bool runOnLoop(Loop *loop, LPPassManager &LPM);
   virtual void getAnalysisUsage (AnalysisUsage &) const;
+
+private:
+  // Upper bound of the number of iterations of loop, or 0 if unknown
+  static uint64_t getTripCount(Loop *loop, ScalarEvolution &SE);
+
+  // Pick the placement for AutoPlacement
+  static Placement choosePlacement(Loop *loop, uint64_t tripCount);
+
+  // Put a predicate between the header and the loop body. With a non zero
+  // stride, it is only evaluated on every stride th iteration. info and DT,
+  // if given, are updated for the new blocks
+  static void obfuscateHeader(Loop *loop, BranchInst *branch,
+                              BasicBlock *exitBlock, unsigned stride,
+                              LoopInfo &info, DominatorTree *DT);
+
+  // Put a predicate in front of the loop
+  static void obfuscatePreheader(Loop *loop, LoopInfo &info,
+                                 DominatorTree *DT);
 };
 
 #endif
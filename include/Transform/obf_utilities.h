@@ -12,9 +12,16 @@
 #ifndef OBF_UTILITIES_H
 #define OBF_UTILITIES_H
 
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
 #include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
 #include "llvm/Analysis/Dominators.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Pass.h"
+#include <random>
 using namespace llvm;
 
 namespace ObfUtils {
@@ -30,13 +37,99 @@ enum ObfType {
 void tagFunction(Function &F, ObfType type);
 void tagFunction(Function &F, ObfType type, ArrayRef<Value *> values);
 
+// Metadata kind of the tags of type. A string lookup in the context, so
+// passes visiting many instructions look it up once and use the overloads
+// taking the kind
+unsigned getMetaKind(LLVMContext &context, ObfType type);
+
 // Check if a function has been tagged as obfuscated
 MDNode *checkFunctionTagged(Function &F, ObfType type);
+MDNode *checkFunctionTagged(Function &F, unsigned metaKind);
 
 bool removeTagIfExists(Instruction &F, ObfType type);
+bool removeTagIfExists(Instruction &F, unsigned metaKind);
+
+// Demote a PHI node or a value used across blocks to a stack slot, like
+// DemotePHIToStack and DemoteRegToStack. The slot is remembered so that
+// promoteDemoted can turn it back into registers
+AllocaInst *demotePHI(PHINode *phi);
+AllocaInst *demoteValue(Instruction *inst);
+
+// Promote those of allocas that are still promotable. DT has to be up to date
+void promoteAllocas(ArrayRef<AllocaInst *> allocas, DominatorTree &DT);
+
+// Split block before splitPt like BasicBlock::splitBasicBlock. If given, DT
+// and LI are kept up to date: the new block takes over the dominator tree
+// children of block and joins its loop
+BasicBlock *splitBlock(BasicBlock *block, Instruction *splitPt,
+                       DominatorTree *DT, LoopInfo *LI);
+
+// Promote the slots demotePHI and demoteValue created in F. Other allocas are
+// left alone. DT is computed for the purpose unless given. Returns false if
+// there were none
+bool promoteDemoted(Function &F, DominatorTree *DT = nullptr);
+
+// Forget the slots demoted in M that have not been promoted
+void clearDemoted(Module &M);
+
+typedef std::mt19937_64 RandomEngine;
+
+// Random number stream of a pass for a whole module or a single function.
+// Streams are seeded from a hash of the master seed (passSeed if set,
+// -obf-seed otherwise), the pass name, the module identifier and the function
+// name. They do not depend on the order functions are visited in, so output
+// is reproducible and every function can be processed independently
+RandomEngine getEngine(StringRef pass, StringRef passSeed, const Module &M);
+RandomEngine getEngine(StringRef pass, StringRef passSeed, const Function &F);
+
+// Classifies the basic blocks of a function by their estimated execution
+// frequency so that passes can keep expensive transformations off hot paths.
+// A block is hot if its frequency is at or above the configured percentile of
+// the function's blocks and it runs more often than the entry block. Blocks
+// calling cold or noreturn functions and all blocks of cold functions are
+// never hot.
+class HotnessFilter {
+public:
+  HotnessFilter(Function &F, BlockFrequencyInfo &BFI);
+
+  // Check if hotness-aware selection has been requested (-obf-hotness)
+  static bool isEnabled();
+
+  bool isHot(const BasicBlock *block) const;
+
+  // Multiplier for the probability of transforming a block. 1 for blocks that
+  // are not hot and -obf-hot-weight for hot blocks
+  double weight(const BasicBlock *block) const;
+
+  // Log a hot block that has been excluded by a pass if -obf-hot-report
+  void reportExcluded(StringRef pass, const BasicBlock *block) const;
+
+private:
+  DenseMap<const BasicBlock *, uint64_t> frequencies;
+  uint64_t threshold;
+  uint64_t entryFrequency;
+  bool coldFunction;
+};
+};
+
+// Promotes the slots the obfuscation passes demoted values to. Cheaper than a
+// full mem2reg between passes, as it neither scans for allocas nor touches
+// functions that have not been demoted
+struct PromoteDemoted : public FunctionPass {
+  static char ID;
 
-// Promote all allocas to PHO, if possible
-void promoteAllocas(Function &F, DominatorTree &DT);
+  PromoteDemoted() : FunctionPass(ID) {}
+  virtual bool runOnFunction(Function &F) {
+    return ObfUtils::promoteDemoted(F,
+                                    getAnalysisIfAvailable<DominatorTree>());
+  }
+  virtual bool doFinalization(Module &M) {
+    ObfUtils::clearDemoted(M);
+    return false;
+  }
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const {
+    AU.setPreservesCFG();
+  }
 };
 
 #endif
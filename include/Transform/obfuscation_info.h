@@ -0,0 +1,60 @@
+//=== obfuscation_info.h - Facts shared by the obfuscation passes ---------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+// Classifies the blocks of a function, checks which obfuscation passes can
+// handle it and reads the tag left by Copy, all in a single scan shared by
+// Copy, BogusCF and Flatten. As an analysis, it is recomputed by the pass
+// manager once a pass that does not preserve it has changed the function.
+
+#ifndef OBFUSCATION_INFO_H
+#define OBFUSCATION_INFO_H
+
+#include "Transform/obf_utilities.h"
+#include "llvm/Pass.h"
+#include "llvm/PassManager.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Function.h"
+#include <vector>
+using namespace llvm;
+
+struct ObfuscationInfo : public FunctionPass {
+  static char ID;
+
+  ObfuscationInfo()
+      : FunctionPass(ID), bogusCFEligible(false), flattenEligible(false),
+        copyTag(ObfUtils::NoneObf) {}
+  virtual bool runOnFunction(Function &F);
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const {
+    AU.setPreservesAll();
+  }
+
+  // Blocks BogusCF may clone: all but the entry block, landing pads and
+  // blocks with nothing besides PHI nodes and a terminator
+  const std::vector<BasicBlock *> &getBogusCFBlocks() const {
+    return bogusCFBlocks;
+  }
+  // Blocks Flatten may dispatch to: all but the entry block and landing pads
+  const std::vector<BasicBlock *> &getFlattenBlocks() const {
+    return flattenBlocks;
+  }
+
+  bool isBogusCFEligible() const { return bogusCFEligible; }
+  bool isFlattenEligible() const { return flattenEligible; }
+
+  // The obfuscation Copy requires for the function, NoneObf if none
+  ObfUtils::ObfType getCopyTag() const { return copyTag; }
+
+private:
+  std::vector<BasicBlock *> bogusCFBlocks;
+  std::vector<BasicBlock *> flattenBlocks;
+  bool bogusCFEligible;
+  bool flattenEligible;
+  ObfUtils::ObfType copyTag;
+};
+
+#endif
@@ -11,10 +11,13 @@
 
 #ifndef OPAQUE_PREDICATE_H
 #define OPAQUE_PREDICATE_H
+#include "Transform/obf_utilities.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/Pass.h"
 #include "llvm/PassManager.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Instructions.h"
 #include "llvm/IR/Module.h"
 #include <functional>
 #include <vector>
@@ -29,44 +32,87 @@ struct OpaquePredicate : public ModulePass {
     PredicateNone = 0xFF
   };
 
+  // Relative cost of evaluating a formula
+  enum FormulaCost {
+    // A few native width ALU operations
+    CheapFormula = 0,
+    // 64 bit multiplications and divisions
+    MediumFormula,
+    // Multi word arithmetic. Division becomes a library call
+    ExpensiveFormula
+  };
+
+  // Where the global state advanced by predicates lives
+  enum StateStorage {
+    // Plain globals shared by all threads
+    SharedState,
+    // Shared globals, each on its own cache line
+    PaddedState,
+    // One copy per thread
+    ThreadLocalState
+  };
+
+  // Where predicates take their operands from
+  enum PredicateSource {
+    // Globals advanced by every predicate
+    GlobalSource,
+    // Integer values live at the predicate. Falls back to globals
+    LiveSource
+  };
+
   typedef std::function<Value *(BasicBlock *, Value *, Value *,
                                 OpaquePredicate::PredicateType)> Formula;
   typedef std::function<int()> Randomner;
   typedef std::function<PredicateType()> PredicateTypeRandomner;
 
   static char ID;
-  std::mt19937_64 engine;
+  ObfUtils::RandomEngine engine;
   static StringRef stubName;
   static StringRef unreachableMarkName;
   static StringRef unreachableName;
 
   OpaquePredicate() : ModulePass(ID) {}
   virtual bool runOnModule(Module &M);
+  virtual bool doFinalization(Module &M);
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const;
 
+  // Replace the terminator of block with a stub branch to be turned into an
+  // opaque predicate. Stubs are registered with their module, so that
+  // runOnModule only visits the stubs
   static void createStub(BasicBlock *block, BasicBlock *trueBlock,
                          BasicBlock *falseBlock,
                          PredicateType type = PredicateRandom,
                          bool markUnreachable = true);
 
+  // Register a function that may hold stubs copied from elsewhere, by
+  // cloning or inlining, rather than created by createStub. runOnModule
+  // visits every terminator of such functions
+  static void registerStubs(Function &F);
+
   static bool isBasicBlockUnreachable(BasicBlock &block);
   static void clearUnreachable(BasicBlock &block);
 
 private:
   // Prepare module for opaque predicates by adding global variables to the
   // module
-  // Returns a vector of pointers to the global variables generated
+  // Returns a vector of i32 pointers to the state held by the globals, which
+  // are the globals themselves unless they are padded
   // Needs at least 2 global variables
-  static std::vector<GlobalVariable *> prepareModule(Module &M);
+  static std::vector<Constant *> prepareModule(Module &M);
 
   // Given a BasicBlock with NO terminator, and two successor blocks
   // Generate a randomly selected opaque predicate to replace the terminator
-  // and then branch to the given blocks
+  // and then branch to the given blocks. The formula costs at most maxCost.
+  // Without advance, globals are only loaded and never stored
   // Returns the type of predicate produced
   static PredicateType create(BasicBlock *headBlock, BasicBlock *trueBlock,
                               BasicBlock *falseBlock,
-                              const std::vector<GlobalVariable *> &globals,
+                              const std::vector<Constant *> &globals,
+                              const std::vector<Value *> &live,
                               Randomner randomner,
-                              PredicateTypeRandomner typeRand);
+                              PredicateTypeRandomner typeRand,
+                              FormulaCost maxCost = ExpensiveFormula,
+                              bool advance = true);
 
   // Given a BasicBlock with NO terminator, and two successor blocks
   // Generate an always true opaque predicate to replace the terminator
@@ -74,8 +120,11 @@ private:
   // Returns the type of predicate produced
   static void createTrue(BasicBlock *headBlock, BasicBlock *trueBlock,
                          BasicBlock *falseBlock,
-                         const std::vector<GlobalVariable *> &globals,
-                         Randomner randomner);
+                         const std::vector<Constant *> &globals,
+                         const std::vector<Value *> &live,
+                         Randomner randomner,
+                         FormulaCost maxCost = ExpensiveFormula,
+                         bool advance = true);
 
   // Given a BasicBlock with NO terminator, and two successor blocks
   // Generate an always false opaque predicate to replace the terminator
@@ -83,8 +132,31 @@ private:
   // Returns the type of predicate produced
   static void createFalse(BasicBlock *headBlock, BasicBlock *trueBlock,
                           BasicBlock *falseBlock,
-                          const std::vector<GlobalVariable *> &globals,
-                          Randomner randomner);
+                          const std::vector<Constant *> &globals,
+                          const std::vector<Value *> &live,
+                          Randomner randomner,
+                          FormulaCost maxCost = ExpensiveFormula,
+                          bool advance = true);
+
+  // Pick the x and y operands of a formula. Takes two of the live values if
+  // there are enough of them, otherwise advances two globals, or only loads
+  // them without advance
+  static void getOperands(BasicBlock *block,
+                          const std::vector<Constant *> &globals,
+                          const std::vector<Value *> &live, Randomner randomner,
+                          bool advance, Value *&x, Value *&y);
+
+  // Collect the integer values that are available at the end of block: the
+  // function arguments and the instructions of every dominating block that
+  // cannot be undef
+  static std::vector<Value *> getLiveValues(BasicBlock *block,
+                                            DominatorTree *DT);
+
+  // Check that value is not computed from undef or from a load of a stack
+  // slot, which mem2reg may turn into undef. A branch on such a value may be
+  // folded either way. Values deeper than depth operands are rejected
+  static bool isDefined(Value *value, SmallPtrSet<Value *, 16> &visited,
+                        unsigned depth);
 
   static Value *formula0(BasicBlock *block, Value *x1, Value *y1,
                          OpaquePredicate::PredicateType type);
@@ -95,9 +167,25 @@ private:
   static Value *formula2(BasicBlock *block, Value *x1, Value *y1,
                          OpaquePredicate::PredicateType type);
 
-  static Formula getFormula(OpaquePredicate::Randomner randomner);
+  static Value *formula3(BasicBlock *block, Value *x1, Value *y1,
+                         OpaquePredicate::PredicateType type);
+
+  static Value *formula4(BasicBlock *block, Value *x1, Value *y1,
+                         OpaquePredicate::PredicateType type);
+
+  static Value *formula5(BasicBlock *block, Value *x1, Value *y1,
+                         OpaquePredicate::PredicateType type);
+
+  // Randomly pick a formula costing at most maxCost
+  static Formula getFormula(OpaquePredicate::Randomner randomner,
+                            FormulaCost maxCost);
 
-  static Value *advanceGlobal(BasicBlock *block, GlobalVariable *global,
+  // Replace the loads and stores of globals in F with a value kept in
+  // registers. The globals are loaded at function entry, and written back
+  // before returns and before calls that may observe them
+  void hoistState(Function &F, const std::vector<Constant *> &globals);
+
+  static Value *advanceGlobal(BasicBlock *block, Constant *global,
                               OpaquePredicate::Randomner randomner);
 
   static StringRef getStringRef(PredicateType type) {
@@ -114,10 +202,14 @@ private:
       llvm_unreachable("Unknown type");
     }
   }
+  // Mark the successor that a resolved predicate never takes as unlikely
+  static void setBranchWeights(BranchInst *branch, PredicateType type);
+
   static void tagInstruction(Instruction &inst, StringRef metaKindName,
                              PredicateType type = PredicateRandom);
   static PredicateType getInstructionType(Instruction &inst,
                                           StringRef metaKindName);
+  static PredicateType getInstructionType(Instruction &inst, unsigned metaKind);
 
   static void cleanDebug(BasicBlock &block);
 };
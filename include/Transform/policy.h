@@ -0,0 +1,68 @@
+//=== policy.h - Per function obfuscation policy --------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+// Per function choice of transformations and intensity.
+//
+// A policy file given with -obf-policy maps functions, by exact name, glob
+// (* and ?) or regular expression, to the set of transformations they get and
+// how heavily. It is YAML, so JSON works as well:
+//
+//   default:
+//     intensity: light
+//   functions:
+//     - name: main
+//       transforms: none
+//     - glob: "crypto_*"
+//       transforms: [flatten, boguscf, loop-boguscf, inline]
+//       intensity: heavy
+//     - regex: "^(test|bench)_"
+//       intensity: 0
+//
+// Source annotations override the file for a single function:
+//
+//   __attribute__((annotate("obf:flatten,boguscf,heavy"))) void f();
+//   __attribute__((annotate("obf:none"))) void g();
+//
+// Transformations are copy, flatten, boguscf, loop-boguscf and inline, or all
+// and none. Intensity is none, light, medium, heavy or a number between 0 and
+// 1. It replaces the probability options of the passes for the function.
+// Exact names take precedence over patterns, which are tried in order.
+// Functions that no rule applies to are left to the options of each pass.
+// OpaquePredicate and ReplaceInstruction only work on what the governed passes
+// leave behind, so they are not governed themselves.
+
+#ifndef POLICY_H
+#define POLICY_H
+
+#include "llvm/IR/Function.h"
+using namespace llvm;
+
+namespace ObfPolicy {
+enum Transform {
+  CopyTransform = 1 << 0,
+  FlattenTransform = 1 << 1,
+  BogusCFTransform = 1 << 2,
+  LoopBogusCFTransform = 1 << 3,
+  InlineTransform = 1 << 4,
+  AllTransforms = (1 << 5) - 1
+};
+
+// Check if the policy decides for F: a rule of the policy file, its default
+// or an annotation of F applies
+bool governs(Function &F);
+
+// Check if the policy allows transform on F. Always true for functions it
+// does not govern
+bool isAllowed(Function &F, Transform transform);
+
+// Probability of a transformation step on F: the intensity the policy
+// assigns to F, or fallback if there is none
+double getProbability(Function &F, double fallback);
+};
+
+#endif
@@ -0,0 +1,67 @@
+//=== profile.h - Obfuscation overhead profiling --------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+// Two phase, overhead budgeted obfuscation.
+//
+// With -obf-profile-generate, every original basic block counts the number of
+// instructions it executes and the obfuscation passes add a counter to the
+// code they emit (Flatten jump blocks, BogusCF splits and opaque predicates).
+// The counters are appended to -obf-profile-file when the program exits.
+//
+// With -obf-profile-use, the passes read the profile back and skip the
+// transformations whose estimated cost in a function would push the total
+// overhead above -obf-overhead-budget.
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "llvm/Pass.h"
+#include "llvm/PassManager.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Function.h"
+using namespace llvm;
+
+namespace ObfProfile {
+enum SiteKind {
+  BaseSite = 0,
+  FlattenSite,
+  OpaqueSite,
+  BogusCFSite,
+  LoopBogusCFSite
+};
+
+// Check if an instrumented build has been requested (-obf-profile-generate)
+bool isGenerating();
+
+// Add a counter incremented by weight to the start of block
+void instrument(BasicBlock *block, SiteKind kind, unsigned weight = 1);
+
+// Check if the overhead budget allows a transformation in a function.
+// Always true without -obf-profile-use
+bool isAllowed(Function &F, SiteKind kind);
+};
+
+// Counts the instructions executed by every original basic block. Has to run
+// before any obfuscation pass
+struct ProfileInstrument : public FunctionPass {
+  static char ID;
+
+  ProfileInstrument() : FunctionPass(ID) {}
+  virtual bool runOnFunction(Function &F);
+};
+
+// Emits the runtime that writes the counters out at exit. Has to run after
+// every obfuscation pass
+struct ProfileFinalize : public ModulePass {
+  static char ID;
+
+  ProfileFinalize() : ModulePass(ID) {}
+  virtual bool runOnModule(Module &M);
+};
+
+#endif
@@ -8,15 +8,20 @@
 //===----------------------------------------------------------------------===//
 #ifndef REPLACE_INSTRUCTION_H
 #define REPLACE_INSTRUCTION_H
+#include "Transform/obf_utilities.h"
 #include "llvm/Pass.h"
 #include "llvm/PassManager.h"
 using namespace llvm;
 
 struct ReplaceInstruction : public BasicBlockPass {
   static char ID;
+  ObfUtils::RandomEngine engine;
 
   ReplaceInstruction() : BasicBlockPass(ID) {}
+  using BasicBlockPass::doInitialization;
+  virtual bool doInitialization(Function &F);
   virtual bool runOnBasicBlock (BasicBlock &BB);
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const;
 };
 
 #endif
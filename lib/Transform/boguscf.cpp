@@ -16,7 +16,16 @@
 // Command line options
 // - bcfFunc - List of functions to apply transformation to. Default is all
 // - bfcProbability - Probability that basic block is transformed. Default 0.5
-// - bcfSeed - Seed for random number generator. Defaults to system time
+// - bcfSeed - Seed for random number generator. Defaults to -obf-seed
+// - bcfSSA - Merge original and cloned values with PHI nodes instead of
+//   demoting them to the stack
+// - bcfDecoyPool - Number of shared decoy blocks per function. Never taken
+//   edges point into the pool instead of a clone of each block. Default 0
+// - bcfDecoyReuse - Maximum number of predicates sharing a decoy block before
+//   falling back to clones. 0 for no limit
+// - obf-hotness - Exclude or down-weight hot blocks (see ObfUtils)
+// - obf-policy - Per function transformations and probability, overriding
+//   bcfFunc and bcfProbability (see ObfPolicy)
 //
 // Debug types:
 // - boguscf - Bogus CF related
@@ -25,9 +34,11 @@
 
 #define DEBUG_TYPE "boguscf"
 #include "Transform/boguscf.h"
-#include "Transform/copy.h"
+#include "Transform/obfuscation_info.h"
 #include "Transform/opaque_predicate.h"
 #include "Transform/obf_utilities.h"
+#include "Transform/policy.h"
+#include "Transform/profile.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Value.h"
@@ -35,6 +46,8 @@
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/User.h"
@@ -44,8 +57,8 @@
 #include "llvm/Support/CFG.h"
 #include "llvm/Transforms/Utils/Local.h"
 #include <algorithm>
+#include <memory>
 #include <vector>
-#include <chrono>
 
 static cl::list<std::string>
     bcfFunc("bcfFunc", cl::CommaSeparated,
@@ -58,17 +71,36 @@ static cl::opt<double>
 
 static cl::opt<std::string> bcfSeed(
     "bcfSeed", cl::init(""),
-    cl::desc("Seed for random number generator. Defaults to system time"));
+    cl::desc("Seed for random number generator. Defaults to -obf-seed"));
 
 static cl::opt<bool> disableBcf(
     "disableBcf", cl::init(false),
     cl::desc("Disable BCF pass regardless. Useful when used in -OX mode."));
 
+static cl::opt<bool> bcfSSA(
+    "bcfSSA", cl::init(false),
+    cl::desc("Keep values in SSA form with PHI nodes instead of demoting them "
+             "to the stack"));
+
+static cl::opt<unsigned> bcfDecoyPool(
+    "bcfDecoyPool", cl::init(0),
+    cl::desc("Number of decoy blocks shared by the bogus edges of a function. "
+             "0 to clone every transformed block instead"));
+
+static cl::opt<unsigned> bcfDecoyReuse(
+    "bcfDecoyReuse", cl::init(0),
+    cl::desc("Maximum number of bogus edges into the same decoy block. 0 for "
+             "no limit"));
+
 STATISTIC(NumBlocksSeen, "Number of basic blocks processed (excluding skips "
                          "due to PHI/terminator only blocks)");
 STATISTIC(NumBlocksSkipped,
           "Number of blocks skipped due to PHI/terminator only blocks");
 STATISTIC(NumBlocksTransformed, "Number of basic blocks transformed");
+STATISTIC(NumBlocksHot, "Number of hot basic blocks excluded");
+STATISTIC(NumPHIsMerged, "Number of PHI nodes merging original and clone");
+STATISTIC(NumDecoys, "Number of decoy blocks created");
+STATISTIC(NumBlocksDecoyed, "Number of blocks given a shared decoy");
 
 // Initialise and check options
 bool BogusCF::doInitialization(Module &M) {
@@ -77,16 +109,6 @@ bool BogusCF::doInitialization(Module &M) {
     ctx.emitError("BogusCF: Probability must be between 0 and 1");
   }
 
-  // Seed engine and create distribution
-  if (!bcfSeed.empty()) {
-    std::seed_seq seed(bcfSeed.begin(), bcfSeed.end());
-    engine.seed(seed);
-  } else {
-    unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-    engine.seed(seed);
-  }
-  trial.param(std::bernoulli_distribution::param_type((double)bcfProbability));
-
   return false;
 }
 
@@ -101,8 +123,17 @@ bool BogusCF::runOnFunction(Function &F) {
     return false;
   }
 
-  bool mustObfuscate = Copy::isFunctionTagged(F, ObfUtils::BogusCFObf);
-  if (!mustObfuscate && bcfProbability == 0.f) {
+  ObfuscationInfo &info = getAnalysis<ObfuscationInfo>();
+  bool mustObfuscate = info.getCopyTag() == ObfUtils::BogusCFObf;
+  bool governed = ObfPolicy::governs(F);
+  if (!mustObfuscate && governed &&
+      !ObfPolicy::isAllowed(F, ObfPolicy::BogusCFTransform)) {
+    DEBUG(errs() << "bcf: Function '" << F.getName()
+                 << "' excluded by policy\n");
+    return false;
+  }
+  double probability = ObfPolicy::getProbability(F, bcfProbability);
+  if (!mustObfuscate && probability == 0.0) {
     return false;
   }
 
@@ -113,70 +144,48 @@ bool BogusCF::runOnFunction(Function &F) {
   }
 
   auto funcListStart = bcfFunc.begin(), funcListEnd = bcfFunc.end();
-  if (!mustObfuscate && bcfFunc.size() != 0 &&
+  if (!mustObfuscate && !governed && bcfFunc.size() != 0 &&
       std::find(funcListStart, funcListEnd, F.getName()) == funcListEnd) {
     DEBUG(errs() << "\tFunction not requested -- skipping\n");
     return false;
   }
 
-  // Use a vector to store the list of blocks for probabilistic
-  // splitting into two bogus control flow for a later time
-  std::vector<BasicBlock *> blocks;
-  blocks.reserve(F.size());
-  std::vector<PHINode *> phis;
+  if (!ObfProfile::isAllowed(F, ObfProfile::BogusCFSite)) {
+    DEBUG(errs() << "\tOver overhead budget -- skipping\n");
+    return false;
+  }
 
   DEBUG(errs() << "\t" << F.size() << " basic blocks found\n");
-  Twine blockPrefix = "block_";
-  unsigned i = 0;
-  DEBUG(errs() << "\tListing and filtering blocks\n");
-  BasicBlock &entryBlock = F.getEntryBlock();
-  // Get original list of blocks
-  for (auto &block : F) {
-    DEBUG(if (!block.hasName()) {
-      block.setName(blockPrefix + Twine(i++));
-      hasBeenModified |= true;
-    });
-
-    DEBUG(errs() << "\tBlock " << block.getName() << "\n");
-    for (auto &inst : block) {
-      if (PHINode *phi = dyn_cast<PHINode>(&inst)) {
-        phis.push_back(phi);
+  DEBUG({
+    Twine blockPrefix = "block_";
+    unsigned i = 0;
+    for (auto &block : F) {
+      if (!block.hasName()) {
+        block.setName(blockPrefix + Twine(i++));
+        hasBeenModified |= true;
       }
     }
-    BasicBlock::iterator inst1 = block.begin();
-    if (block.getFirstNonPHIOrDbgOrLifetime()) {
-      inst1 = block.getFirstNonPHIOrDbgOrLifetime();
-    }
-    // We do not want to transform a basic block that is only involved with
-    // terminator instruction or is a landing pad for an exception
-    // c.f. http://git.io/OpQeCQ
-    if (isa<TerminatorInst>(inst1)) {
-      DEBUG(errs() << "\t\tSkipping: PHI and Terminator only\n");
-      ++NumBlocksSkipped;
-      continue;
-    }
-    if (block.isLandingPad()) {
-      DEBUG(errs() << "\t\tSkipping: Landing pad block\n");
-      ++NumBlocksSkipped;
-      continue;
-    }
+  });
 
-    if (&block == &entryBlock) {
-      DEBUG(errs() << "\t\tSkipping: Entry block\n");
-      ++NumBlocksSkipped;
-      continue;
-    }
+  // We skip functions with InvokeInst because PHI demotions are not
+  // supported with invoke edges by LLVM yet.
+  if (!info.isBogusCFEligible()) {
+    DEBUG(errs() << "\tNot eligible -- skipping\n");
+    return hasBeenModified;
+  }
 
-    // We skip functions with InvokeInst because PHI demotions are not
-    // supported with invoke edges by LLVM yet.
-    TerminatorInst *terminator = block.getTerminator();
-    if (isa<InvokeInst>(terminator)) {
-      DEBUG(errs() << "\tFunction has InvokeInst -- skipping\n");
-      return hasBeenModified;
-    }
+  // Use a vector to store the list of blocks for probabilistic
+  // splitting into two bogus control flow for a later time
+  std::vector<BasicBlock *> blocks = info.getBogusCFBlocks();
+  NumBlocksSkipped += F.size() - blocks.size();
 
-    DEBUG(errs() << "\t\tAdding block\n");
-    blocks.push_back(&block);
+  std::vector<PHINode *> phis;
+  if (!bcfSSA) {
+    for (auto &block : F) {
+      for (BasicBlock::iterator it = block.begin(); isa<PHINode>(it); ++it) {
+        phis.push_back(cast<PHINode>(it));
+      }
+    }
   }
 
   NumBlocksSeen += blocks.size();
@@ -185,16 +194,36 @@ bool BogusCF::runOnFunction(Function &F) {
     return hasBeenModified;
   }
 
-  DEBUG(errs() << "\tDemoting PHI instructions to allocas\n");
-  for (auto phi : phis) {
-    DemotePHIToStack(phi);
+  // Frequencies have to be read before any block is split
+  std::unique_ptr<ObfUtils::HotnessFilter> hotness;
+  if (ObfUtils::HotnessFilter::isEnabled()) {
+    hotness.reset(new ObfUtils::HotnessFilter(
+        F, getAnalysis<BlockFrequencyInfo>()));
   }
 
+  // Kept up to date as blocks are split and cloned. Not with a decoy pool,
+  // whose blocks branch among themselves
+  DominatorTree *DT = nullptr;
+  LoopInfo *LI = nullptr;
+  if (!bcfDecoyPool) {
+    DT = getAnalysisIfAvailable<DominatorTree>();
+    LI = getAnalysisIfAvailable<LoopInfo>();
+  }
+
+  // PHI nodes are only demoted once a block has to be cloned
+  bool demoted = false;
+  // Decoys that can still take another bogus edge, and how many they have
+  std::vector<BasicBlock *> decoys;
+  std::vector<unsigned> decoyUses;
+  bool pooled = false;
+
   // DEBUG_WITH_TYPE("cfg", F.viewCFG());
 
+  engine = ObfUtils::getEngine("boguscf", bcfSeed, F);
+  trial.param(std::bernoulli_distribution::param_type(probability));
   trial.reset(); // Independent per function
   DEBUG(errs() << "\tRandomly shuffling list of basic blocks\n");
-  std::random_shuffle(blocks.begin(), blocks.end());
+  std::shuffle(blocks.begin(), blocks.end(), engine);
 
   for (BasicBlock *block : blocks) {
     DEBUG(errs() << "\tBlock " << block->getName() << "\n");
@@ -210,7 +239,57 @@ bool BogusCF::runOnFunction(Function &F) {
       continue;
     }
 
+    if (hotness && hotness->isHot(block)) {
+      std::bernoulli_distribution hotTrial(hotness->weight(block));
+      if (!hotTrial(engine)) {
+        DEBUG(errs() << "\t\tSkipping: Hot block\n");
+        hotness->reportExcluded("boguscf", block);
+        ++NumBlocksHot;
+        continue;
+      }
+    }
+
     ++NumBlocksTransformed;
+    hasBeenModified |= true;
+
+    if (bcfDecoyPool && !pooled) {
+      DEBUG(errs() << "\t\tCreating decoy pool\n");
+      decoys = createDecoys(F, bcfDecoyPool);
+      decoyUses.assign(decoys.size(), 0);
+      pooled = true;
+    }
+    if (!decoys.empty()) {
+      std::uniform_int_distribution<unsigned> pick(0, decoys.size() - 1);
+      unsigned index = pick(engine);
+      BasicBlock *decoy = decoys[index];
+      DEBUG(errs() << "\t\tBranching to decoy " << decoy->getName() << "\n");
+      if (bcfDecoyReuse && ++decoyUses[index] == bcfDecoyReuse) {
+        decoys[index] = decoys.back();
+        decoyUses[index] = decoyUses.back();
+        decoys.pop_back();
+        decoyUses.pop_back();
+      }
+
+      // The decoy is never taken, so values need not be merged anywhere
+      BasicBlock *originalBlock = block->splitBasicBlock(inst1);
+      DEBUG(originalBlock->setName(block->getName() + "_original"));
+      block->getTerminator()->eraseFromParent();
+      OpaquePredicate::createStub(block, originalBlock, decoy,
+                                  OpaquePredicate::PredicateTrue, false);
+      if (ObfProfile::isGenerating())
+        ObfProfile::instrument(block, ObfProfile::BogusCFSite);
+      ++NumBlocksDecoyed;
+      continue;
+    }
+
+    if (!demoted) {
+      DEBUG(errs() << "\tDemoting PHI instructions to allocas\n");
+      for (auto phi : phis) {
+        ObfUtils::demotePHI(phi);
+      }
+      demoted = true;
+    }
+
     auto terminator = block->getTerminator();
     bool hasSuccessors = terminator->getNumSuccessors() > 0;
 
@@ -220,7 +299,7 @@ bool BogusCF::runOnFunction(Function &F) {
     // Will be handled as per normal later on
     if (hasSuccessors && terminator->getNumSuccessors() > 1) {
       DEBUG(errs() << "\t\t>1 successor: Creating successor block\n");
-      successor = block->splitBasicBlock(terminator);
+      successor = ObfUtils::splitBlock(block, terminator, DT, LI);
       DEBUG(successor->setName(block->getName() + "_successor"));
 
     } else if (hasSuccessors) {
@@ -228,13 +307,17 @@ bool BogusCF::runOnFunction(Function &F) {
     }
 
     DEBUG(errs() << "\t\tSplitting Basic Block\n");
-    BasicBlock *originalBlock = block->splitBasicBlock(inst1);
+    BasicBlock *originalBlock = ObfUtils::splitBlock(block, inst1, DT, LI);
     DEBUG(originalBlock->setName(block->getName() + "_original"));
     DEBUG(errs() << "\t\tCloning Basic Block\n");
     Twine prefix = "Cloned";
     ValueToValueMapTy VMap;
     BasicBlock *copyBlock = CloneBasicBlock(originalBlock, VMap, prefix, &F);
     DEBUG(copyBlock->setName(block->getName() + "_cloned"));
+    if (LI) {
+      if (Loop *loop = LI->getLoopFor(block))
+        loop->addBasicBlockToLoop(copyBlock, LI->getBase());
+    }
 
     // Remap operands, phi nodes, and metadata
     DEBUG(errs() << "\t\tRemapping information\n");
@@ -245,7 +328,10 @@ bool BogusCF::runOnFunction(Function &F) {
 
     // If this block has a successor, we need to worry about use of Values
     // generated by this block
-    if (successor) {
+    if (successor && bcfSSA) {
+      DEBUG(errs() << "\t\tMerging values in successor\n");
+      mergeSSA(originalBlock, copyBlock, successor, VMap);
+    } else if (successor) {
       DEBUG(errs() << "\t\tHandling successor use\n");
       for (auto &inst : *originalBlock) {
         DEBUG(errs() << "\t\t\t" << inst << "\n");
@@ -363,7 +449,7 @@ bool BogusCF::runOnFunction(Function &F) {
 #endif
 
           DEBUG(errs() << "\t\t\t\t\tDemoting PHI Node to stack\n");
-          DemotePHIToStack(phi);
+          ObfUtils::demotePHI(phi);
         }
       }
 
@@ -397,7 +483,15 @@ bool BogusCF::runOnFunction(Function &F) {
     block->getTerminator()->eraseFromParent();
 
     OpaquePredicate::createStub(block, originalBlock, copyBlock);
-    hasBeenModified |= true;
+    if (DT && DT->getNode(block)) {
+      // The successor is now reached through either copy
+      DT->addNewBlock(copyBlock, block);
+      if (successor &&
+          DT->getNode(successor)->getIDom()->getBlock() == originalBlock)
+        DT->changeImmediateDominator(successor, block);
+    }
+    if (ObfProfile::isGenerating())
+      ObfProfile::instrument(block, ObfProfile::BogusCFSite);
   }
   // DEBUG_WITH_TYPE("cfg", F.viewCFG());
   if (hasBeenModified)
@@ -405,47 +499,132 @@ bool BogusCF::runOnFunction(Function &F) {
   return hasBeenModified;
 }
 
-bool BogusCF::isEligible(Function &F) {
-  DEBUG(errs() << "BogusCF: Checking " << F.getName() << " eligibility:\n");
-  if (F.isDeclaration()) {
-    DEBUG(errs() << "\tIneligible -- declaration\n");
-    return false;
+std::vector<BasicBlock *> BogusCF::createDecoys(Function &F, unsigned size) {
+  LLVMContext &context = F.getContext();
+  Type *intType = Type::getInt32Ty(context);
+  std::vector<BasicBlock *> decoys(size);
+  for (auto &decoy : decoys) {
+    decoy = BasicBlock::Create(context, "", &F);
+    DEBUG(decoy->setName("decoy"));
+    ++NumDecoys;
   }
-  unsigned eligibleBB = 0;
-  DEBUG(errs() << "\tInspecting basic blocks\n");
-  BasicBlock &entryBlock = F.getEntryBlock();
-  for (auto &block : F) {
-    BasicBlock::iterator inst1 = block.begin();
-    if (block.getFirstNonPHIOrDbgOrLifetime()) {
-      inst1 = block.getFirstNonPHIOrDbgOrLifetime();
+
+  // Arguments dominate every block, so decoys can compute on them wherever
+  // they are branched to from
+  std::vector<Value *> inputs;
+  for (auto &arg : F.getArgumentList()) {
+    if (arg.getType()->isIntegerTy())
+      inputs.push_back(&arg);
+  }
+
+  std::uniform_int_distribution<int> constant(1, 0xFFFF);
+  std::uniform_int_distribution<int> smallConstant(1, 0x1F);
+  // Without integer arguments everything would fold into constants. Nothing
+  // can assume the value of a volatile load
+  GlobalVariable *seed = new GlobalVariable(
+      *F.getParent(), intType, false, GlobalValue::PrivateLinkage,
+      ConstantInt::get(intType, constant(engine)), "");
+  std::uniform_int_distribution<unsigned> length(4, 8);
+  std::uniform_int_distribution<unsigned> pickDecoy(0, size - 1);
+  std::bernoulli_distribution coin(0.5);
+  static const Instruction::BinaryOps ops[] = {
+    Instruction::Add, Instruction::Sub, Instruction::Mul, Instruction::Xor,
+    Instruction::And, Instruction::Or,  Instruction::Shl, Instruction::LShr
+  };
+  std::uniform_int_distribution<unsigned> pickOp(
+      0, sizeof(ops) / sizeof(ops[0]) - 1);
+
+  for (auto decoy : decoys) {
+    IRBuilder<> builder(decoy);
+    std::vector<Value *> values;
+    for (auto input : inputs) {
+      values.push_back(builder.CreateSExtOrTrunc(input, intType));
     }
-    if (isa<TerminatorInst>(inst1)) {
-      continue;
+    values.push_back(builder.CreateLoad(seed, true));
+    for (unsigned i = 0, iEnd = length(engine); i < iEnd; ++i) {
+      std::uniform_int_distribution<unsigned> pickValue(0, values.size() - 1);
+      Value *lhs = values[pickValue(engine)];
+      // Neither a zero constant nor lhs itself, which x - x and the like
+      // would simplify away
+      Value *rhs = values[pickValue(engine)];
+      if (coin(engine) || rhs == lhs)
+        rhs = ConstantInt::get(intType, smallConstant(engine));
+      values.push_back(builder.CreateBinOp(ops[pickOp(engine)], lhs, rhs));
     }
-    if (block.isLandingPad()) {
+    Value *junk = values.back();
+
+    // Decoys jump around the pool and eventually return
+    if (size > 1 && coin(engine)) {
+      Value *condition = builder.CreateICmpULT(
+          junk, ConstantInt::get(intType, constant(engine)));
+      builder.CreateCondBr(condition, decoys[pickDecoy(engine)],
+                           decoys[pickDecoy(engine)]);
       continue;
     }
+    Type *returnType = F.getReturnType();
+    if (returnType->isVoidTy())
+      builder.CreateRetVoid();
+    else if (returnType->isIntegerTy())
+      builder.CreateRet(builder.CreateSExtOrTrunc(junk, returnType));
+    else
+      builder.CreateRet(Constant::getNullValue(returnType));
+  }
+  return decoys;
+}
 
-    if (&block == &entryBlock) {
+void BogusCF::mergeSSA(BasicBlock *originalBlock, BasicBlock *copyBlock,
+                       BasicBlock *successor, ValueToValueMapTy &VMap) {
+  // Existing PHI nodes gain an incoming value for the clone
+  for (auto &inst : *successor) {
+    PHINode *phi = dyn_cast<PHINode>(&inst);
+    if (!phi)
+      break;
+    int index = phi->getBasicBlockIndex(originalBlock);
+    if (index == -1)
       continue;
+    Value *incoming = phi->getIncomingValue(index);
+    Value *mapped = VMap.lookup(incoming);
+    phi->addIncoming(mapped ? mapped : incoming, copyBlock);
+  }
+
+  // Any other use outside of the split block is dominated by the successor,
+  // which could only be reached from the original block
+  for (auto &inst : *originalBlock) {
+    std::vector<Use *> uses;
+    for (auto user = inst.use_begin(), useEnd = inst.use_end(); user != useEnd;
+         ++user) {
+      Instruction *userInst = cast<Instruction>(*user);
+      BasicBlock *userBlock = userInst->getParent();
+      if (userBlock == originalBlock || userBlock == copyBlock)
+        continue;
+      PHINode *phiUser = dyn_cast<PHINode>(userInst);
+      if (phiUser && userBlock == successor &&
+          phiUser->getIncomingBlock(user.getUse()) == originalBlock)
+        continue;
+      uses.push_back(&user.getUse());
     }
+    if (uses.empty())
+      continue;
 
-    // We skip functions with InvokeInst because PHI demotions are not
-    // supported with invoke edges by LLVM yet.
-    TerminatorInst *terminator = block.getTerminator();
-    if (isa<InvokeInst>(terminator)) {
-      DEBUG(errs() << "\tIneligible -- Function has InvokeInst\n");
-      return false;
+    DEBUG(errs() << "\t\t\tMerging " << inst << "\n");
+    PHINode *phi = PHINode::Create(inst.getType(), 2, "", successor->begin());
+    phi->addIncoming(&inst, originalBlock);
+    phi->addIncoming(VMap[&inst], copyBlock);
+    for (auto use : uses) {
+      use->set(phi);
     }
-    ++eligibleBB;
+    ++NumPHIsMerged;
   }
+}
 
-  if (!eligibleBB) {
-    DEBUG(errs() << "\tIneligible -- No eligible basic blocks\n");
-    return false;
+void BogusCF::getAnalysisUsage(AnalysisUsage &AU) const {
+  AU.addRequired<ObfuscationInfo>();
+  if (ObfUtils::HotnessFilter::isEnabled())
+    AU.addRequired<BlockFrequencyInfo>();
+  if (!bcfDecoyPool) {
+    AU.addPreserved<DominatorTree>();
+    AU.addPreserved<LoopInfo>();
   }
-  DEBUG(errs() << "\tEligible\n");
-  return true;
 }
 
 char BogusCF::ID = 0;
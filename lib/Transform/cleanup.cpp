@@ -10,6 +10,7 @@
 #include "Transform/cleanup.h"
 #include "Transform/obf_utilities.h"
 #include "llvm/IR/GlobalValue.h"
+#include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Value.h"
 #include "llvm/IR/Instruction.h"
@@ -21,19 +22,25 @@
 
 bool CleanupPass::runOnFunction(Function &F) {
   bool hasBeenModified = false;
+  LLVMContext &context = F.getContext();
+  unsigned flattenKind = ObfUtils::getMetaKind(context, ObfUtils::FlattenObf);
+  unsigned bogusKind = ObfUtils::getMetaKind(context, ObfUtils::BogusCFObf);
+  unsigned copyKind = ObfUtils::getMetaKind(context, ObfUtils::CopyObf);
   for (auto &block : F) {
     for (auto &inst : block) {
-      hasBeenModified |=
-          ObfUtils::removeTagIfExists(inst, ObfUtils::FlattenObf);
-      hasBeenModified |=
-          ObfUtils::removeTagIfExists(inst, ObfUtils::BogusCFObf);
-      hasBeenModified |=
-          ObfUtils::removeTagIfExists(inst, ObfUtils::CopyObf);
+      hasBeenModified |= ObfUtils::removeTagIfExists(inst, flattenKind);
+      hasBeenModified |= ObfUtils::removeTagIfExists(inst, bogusKind);
+      hasBeenModified |= ObfUtils::removeTagIfExists(inst, copyKind);
     }
   }
   return hasBeenModified;
 }
 
+// Only metadata is removed
+void CleanupPass::getAnalysisUsage(AnalysisUsage &AU) const {
+  AU.setPreservesAll();
+}
+
 char CleanupPass::ID = 0;
 static RegisterPass<CleanupPass>
     X("cleanup", "Cleanup Residues left over by obfuscation passes", false,
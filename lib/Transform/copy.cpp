@@ -8,8 +8,9 @@
 //===----------------------------------------------------------------------===//
 #define DEBUG_TYPE "copy"
 #include "Transform/copy.h"
-#include "Transform/boguscf.h"
-#include "Transform/flatten.h"
+#include "Transform/obfuscation_info.h"
+#include "Transform/opaque_predicate.h"
+#include "Transform/policy.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Value.h"
@@ -24,7 +25,6 @@
 #include "llvm/Support/CFG.h"
 #include <algorithm>
 #include <vector>
-#include <chrono>
 
 static cl::list<std::string> copyFunc("copyFunc", cl::CommaSeparated,
                                       cl::desc("Only copy some functions: "
@@ -42,7 +42,7 @@ static cl::opt<double>
 
 static cl::opt<std::string> copySeed(
     "copySeed", cl::init(""),
-    cl::desc("Seed for random number generator. Defaults to system time"));
+    cl::desc("Seed for random number generator. Defaults to -obf-seed"));
 
 static cl::opt<bool> copyEnsureEligibility(
     "copyEnsureEligibility", cl::init(true),
@@ -73,19 +73,6 @@ bool Copy::runOnModule(Module &M) {
     ctx.emitError("Copy: copyReplaceProbability must be between 0 and 1");
   }
 
-  if (copyProbability == 0.f) {
-    return false;
-  }
-  // Seed engine and create distribution
-  if (!copySeed.empty()) {
-    std::seed_seq seed(copySeed.begin(), copySeed.end());
-    engine.seed(seed);
-  } else {
-    unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-    engine.seed(seed);
-  }
-
-  trial.param(std::bernoulli_distribution::param_type((double)copyProbability));
   trialReplace.param(
       std::bernoulli_distribution::param_type((double)copyReplaceProbability));
 
@@ -97,8 +84,18 @@ bool Copy::runOnModule(Module &M) {
       continue;
 
     DEBUG(errs() << "Copy: Function '" << F.getName() << "'\n");
-    if (copyFunc.empty()) {
+    bool governed = ObfPolicy::governs(F);
+    if (governed && !ObfPolicy::isAllowed(F, ObfPolicy::CopyTransform)) {
+      DEBUG(errs() << "\tExcluded by policy -- skipping\n");
+      continue;
+    }
+    double probability = ObfPolicy::getProbability(F, copyProbability);
+    if (probability == 0.0)
+      continue;
+    if (copyFunc.empty() || governed) {
       // Play dice
+      trial.param(std::bernoulli_distribution::param_type(probability));
+      engine = ObfUtils::getEngine("copy", copySeed, F);
       if (!trial(engine)) {
         DEBUG(errs() << "\tSkipping: Bernoulli trial failed\n");
         continue;
@@ -115,17 +112,19 @@ bool Copy::runOnModule(Module &M) {
 
   for (Function *F : cloneList) {
     DEBUG(errs() << F->getName() << ":\n");
+    engine = ObfUtils::getEngine("copy-replace", copySeed, *F);
 
     ObfUtils::ObfType mustObfType = ObfUtils::NoneObf;
     if (copyEnsureEligibility) {
       std::vector<ObfUtils::ObfType> eligible;
       DEBUG(errs() << "\tChecking eligibility:\n");
 
-      if (BogusCF::isEligible(*F)) {
+      ObfuscationInfo &info = getAnalysis<ObfuscationInfo>(*F);
+      if (info.isBogusCFEligible()) {
         DEBUG(errs() << "\t\tBogusCF\n");
         eligible.push_back(ObfUtils::BogusCFObf);
       }
-      if (Flatten::isEligible(*F)) {
+      if (info.isFlattenEligible()) {
         DEBUG(errs() << "\t\tFlatten\n");
         eligible.push_back(ObfUtils::FlattenObf);
       }
@@ -184,6 +183,8 @@ bool Copy::runOnModule(Module &M) {
     }
     SmallVector<ReturnInst *, 8> Returns; // Ignore returns cloned.
     CloneFunctionInto(clone, F, VMap, true, Returns);
+    // Stubs of F, if any, have been cloned as well
+    OpaquePredicate::registerStubs(*clone);
 
     // Tag cloned function
     if (mustObfType != ObfUtils::NoneObf) {
@@ -237,8 +238,15 @@ void Copy::tagFunction(Function &F, ObfUtils::ObfType type) {
                         MDString::get(F.getContext(), obfString(type)));
 }
 
+void Copy::getAnalysisUsage(AnalysisUsage &AU) const {
+  // Only calls are redirected to the clones
+  AU.setPreservesCFG();
+  if (copyEnsureEligibility)
+    AU.addRequired<ObfuscationInfo>();
+}
+
 bool Copy::isFunctionTagged(Function &F, ObfUtils::ObfType type) {
-  MDNode *md = ObfUtils::checkFunctionTagged(F, type);
+  MDNode *md = ObfUtils::checkFunctionTagged(F, ObfUtils::CopyObf);
   if (!md)
     return false;
   if (md->getNumOperands() < 1)
@@ -9,15 +9,22 @@
 // http://ac.inf.elte.hu/Vol_030_2009/003.pdf
 #define DEBUG_TYPE "flatten"
 #include "Transform/flatten.h"
-#include "Transform/copy.h"
+#include "Transform/obfuscation_info.h"
 #include "Transform/obf_utilities.h"
+#include "Transform/policy.h"
+#include "Transform/profile.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/Analysis/Dominators.h"
+#include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Utils/Local.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Module.h"
@@ -30,8 +37,8 @@
 #include "llvm/Support/CFG.h"
 #include <algorithm>
 #include <vector>
-#include <chrono>
 #include <random>
+#include <utility>
 
 using namespace llvm;
 
@@ -42,7 +49,7 @@ flattenFunc("flattenFunc", cl::CommaSeparated,
 
 static cl::opt<std::string> flattenSeed(
     "flattenSeed", cl::init(""),
-    cl::desc("Seed for random number generator. Defaults to system time"));
+    cl::desc("Seed for random number generator. Defaults to -obf-seed"));
 
 static cl::opt<double>
 flattenProbability("flattenProbability", cl::init(0.5),
@@ -52,13 +59,57 @@ static cl::opt<bool> disableFlatten(
     "disableFlatten", cl::init(false),
     cl::desc("Disable Flatten pass regardless. Useful when used in -OX mode."));
 
+static cl::opt<bool> flattenThreaded(
+    "flattenThreaded", cl::init(false),
+    cl::desc("Copy the dispatcher to the end of every flattened block so each "
+             "transition has its own indirect branch"));
+
+static cl::opt<bool> flattenKeepLoops(
+    "flattenKeepLoops", cl::init(false),
+    cl::desc("Leave innermost loops out of the dispatcher so they keep their "
+             "optimised shape"));
+
+static cl::opt<bool> flattenSSA(
+    "flattenSSA", cl::init(false),
+    cl::desc("Keep values in SSA form with PHI nodes instead of demoting them "
+             "to the stack"));
+
+static cl::opt<Flatten::DispatchStrategy> flattenDispatch(
+    "flattenDispatch", cl::init(Flatten::TableDispatch),
+    cl::desc("Dispatcher used by flattened functions:"),
+    cl::values(clEnumValN(Flatten::TableDispatch, "table",
+                          "Indirect branch through a jump table (default)"),
+               clEnumValN(Flatten::SwitchDispatch, "switch",
+                          "Switch on the state value"),
+               clEnumValN(Flatten::DirectDispatch, "direct",
+                          "Indirect branch to the block address held in the "
+                          "state"),
+               clEnumValN(Flatten::RelativeDispatch, "relative",
+                          "Indirect branch through a read-only table of "
+                          "relative offsets"),
+               clEnumValEnd));
+
+static cl::opt<unsigned> flattenMaxFanOut(
+    "flattenMaxFanOut", cl::init(0),
+    cl::desc("Maximum number of blocks a dispatcher branches to. Larger "
+             "functions get one dispatcher per cluster of blocks. 0 for no "
+             "limit"));
+
+STATISTIC(NumBlocksHot, "Number of hot basic blocks left out of dispatchers");
+STATISTIC(NumBlocksLoop, "Number of innermost loop blocks left intact");
+STATISTIC(NumSSAValues, "Number of values rejoined in SSA form");
+STATISTIC(NumThreaded, "Number of dispatchers replicated into blocks");
+STATISTIC(NumDispatchers, "Number of dispatchers created");
+STATISTIC(NumClusterHops, "Number of branches between dispatcher clusters");
+
 Value *Flatten::findBlock(LLVMContext &context,
-                          std::vector<BasicBlock *> &blocks,
+                          DenseMap<BasicBlock *, unsigned> &indices,
                           BasicBlock *block) {
-  auto iterator = std::find(blocks.begin(), blocks.end(), block);
-  assert(iterator != blocks.end() && "Block does not exist in vector!");
-  unsigned index = iterator - blocks.begin();
-  return ConstantInt::get(Type::getInt32Ty(context), index, false);
+  auto iterator = indices.find(block);
+  assert(iterator != indices.end() && "Block does not exist in map!");
+  if (flattenDispatch == DirectDispatch)
+    return BlockAddress::get(block);
+  return ConstantInt::get(Type::getInt32Ty(context), iterator->second, false);
 }
 
 // Initialise and check options
@@ -70,16 +121,6 @@ bool Flatten::doInitialization(Module &M) {
     LLVMContext &ctx = getGlobalContext();
     ctx.emitError("Flatten: Probability must be between 0 and 1");
   }
-  // Seed engine and create distribution
-  if (!flattenSeed.empty()) {
-    std::seed_seq seed(flattenSeed.begin(), flattenSeed.end());
-    engine.seed(seed);
-  } else {
-    unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-    engine.seed(seed);
-  }
-  trial.param(
-      std::bernoulli_distribution::param_type((double)flattenProbability));
 
   return false;
 }
@@ -90,69 +131,51 @@ bool Flatten::runOnFunction(Function &F) {
   if (F.isDeclaration()) {
     return false;
   }
-  bool mustObfuscate = Copy::isFunctionTagged(F, ObfUtils::FlattenObf);
+  ObfuscationInfo &info = getAnalysis<ObfuscationInfo>();
+  bool mustObfuscate = info.getCopyTag() == ObfUtils::FlattenObf;
   DEBUG(errs() << "flatten: Function '" << F.getName() << "'\n");
 
+  bool governed = ObfPolicy::governs(F);
+  if (!mustObfuscate && governed &&
+      !ObfPolicy::isAllowed(F, ObfPolicy::FlattenTransform)) {
+    DEBUG(errs() << "\tExcluded by policy -- skipping\n");
+    return false;
+  }
+
   // Check if function is requested
   auto funcListStart = flattenFunc.begin(), funcListEnd = flattenFunc.end();
-  if (!mustObfuscate && flattenFunc.size() != 0 &&
+  if (!mustObfuscate && !governed && flattenFunc.size() != 0 &&
       std::find(funcListStart, funcListEnd, F.getName()) == funcListEnd) {
     DEBUG(errs() << "\tFunction not requested -- skipping\n");
     return false;
   }
 
-  LLVMContext &context = F.getContext();
+  if (!ObfProfile::isAllowed(F, ObfProfile::FlattenSite)) {
+    DEBUG(errs() << "\tOver overhead budget -- skipping\n");
+    return false;
+  }
 
-  // Use a vector to store the list of blocks
-  std::vector<BasicBlock *> blocks;
-  blocks.reserve(F.size());
+  LLVMContext &context = F.getContext();
 
   DEBUG(errs() << "\t" << F.size() << " basic blocks found\n");
-  Twine blockPrefix = "block_";
-  unsigned i = 0;
-  DEBUG(errs() << "\tListing and filtering blocks\n");
-  // Get original list of blocks
-  for (auto &block : F) {
-    DEBUG(if (!block.hasName()) { block.setName(blockPrefix + Twine(i++)); });
-
-    DEBUG(errs() << "\tBlock " << block.getName() << "\n");
-    BasicBlock::iterator inst1 = block.begin();
-    if (block.getFirstNonPHIOrDbgOrLifetime()) {
-      inst1 = block.getFirstNonPHIOrDbgOrLifetime();
-    }
-
-    if (isa<IndirectBrInst>(block.getTerminator())) {
-      // TODO Maybe handle this
-      DEBUG(errs() << "\tSkipping function -- IndirectBrInst encountered\n");
-      return false;
-    }
-
-    if (isa<SwitchInst>(block.getTerminator())) {
-      // TODO Maybe handle this
-      DEBUG(errs() << "\tSkipping function -- SwitchInst encountered\n");
-      return false;
-    }
-
-    // LLVM does not support PHINodes for Invoke Edges
-    if (isa<InvokeInst>(block.getTerminator())) {
-      // TODO Maybe handle this
-      DEBUG(errs() << "\tSkipping function -- InvokeInst encountered\n");
-      return false;
+  DEBUG({
+    Twine blockPrefix = "block_";
+    unsigned i = 0;
+    for (auto &block : F) {
+      if (!block.hasName())
+        block.setName(blockPrefix + Twine(i++));
     }
+  });
 
-    if (block.isLandingPad()) {
-      DEBUG(errs() << "\t\tSkipping: Landing pad block\n");
-      continue;
-    }
-    if (&block == &F.getEntryBlock()) {
-      DEBUG(errs() << "\t\tSkipping: Entry block\n");
-      continue;
-    }
-
-    DEBUG(errs() << "\t\tAdding block\n");
-    blocks.push_back(&block);
+  // Switches, indirect branches and invokes are not supported
+  if (!info.isFlattenEligible()) {
+    DEBUG(errs() << "\tNot eligible -- skipping\n");
+    return false;
   }
 
+  // Use a vector to store the list of blocks
+  std::vector<BasicBlock *> blocks = info.getFlattenBlocks();
+
   DEBUG(errs() << "\t" << blocks.size() << " basic blocks remaining\n");
   if (blocks.size() < 2) {
     DEBUG(errs() << "\tNothing left to flatten\n");
@@ -167,30 +190,64 @@ bool Flatten::runOnFunction(Function &F) {
     return false;
   }
 
+  engine = ObfUtils::getEngine("flatten", flattenSeed, F);
+  trial.param(std::bernoulli_distribution::param_type(
+      ObfPolicy::getProbability(F, flattenProbability)));
   if (!trial(engine)) {
     DEBUG(errs() << "\tSkipping: Bernoulli trial failed\n");
     return false;
   }
 
-  // DEBUG_WITH_TYPE("cfg", F.viewCFG());
+  // Hot blocks and innermost loops are left out of the dispatcher. They keep
+  // their terminators and flattened blocks branch to them directly
+  SmallPtrSet<BasicBlock *, 16> excluded;
+  if (ObfUtils::HotnessFilter::isEnabled()) {
+    ObfUtils::HotnessFilter hotness(F, getAnalysis<BlockFrequencyInfo>());
+    for (auto block : blocks) {
+      if (!hotness.isHot(block))
+        continue;
+      std::bernoulli_distribution hotTrial(hotness.weight(block));
+      if (hotTrial(engine))
+        continue;
+      DEBUG(errs() << "\t" << block->getName() << ": Hot block excluded\n");
+      hotness.reportExcluded("flatten", block);
+      excluded.insert(block);
+      ++NumBlocksHot;
+    }
+  }
 
-  // Demote all the PHI Nodes to stack
-  DEBUG(errs() << "\tDemoting PHI Nodes to stack\n");
-  for (auto block : blocks) {
-    std::vector<PHINode *> phis;
-    for (auto &inst : *block) {
-      if (PHINode *phiInst = dyn_cast<PHINode>(&inst)) {
-        phis.push_back(phiInst);
+  if (flattenKeepLoops) {
+    // Loops keep their shape for LICM, unrolling and vectorisation. They are
+    // entered through their preheader, which is still dispatched to
+    LoopInfo &loopInfo = getAnalysis<LoopInfo>();
+    for (auto block : blocks) {
+      Loop *loop = loopInfo.getLoopFor(block);
+      if (loop && loop->empty() && excluded.insert(block)) {
+        DEBUG(errs() << "\t" << block->getName() << ": Innermost loop\n");
+        ++NumBlocksLoop;
       }
     }
-    for (auto phiInst : phis) {
-      DemotePHIToStack(phiInst);
+  }
+
+  if (!excluded.empty()) {
+    blocks.erase(std::remove_if(blocks.begin(), blocks.end(),
+                                [&](BasicBlock *block) {
+                   return excluded.count(block);
+                 }),
+                 blocks.end());
+    if (blocks.size() < 2) {
+      DEBUG(errs() << "\tNothing left to flatten\n");
+      return false;
     }
   }
 
+  // DEBUG_WITH_TYPE("cfg", F.viewCFG());
+
   BasicBlock *initialBlock;
-  // Going to have to split the entry block into 2 blocks
-  if (entryBlock.getTerminator()->getNumSuccessors() > 1) {
+  // Going to have to split the entry block into 2 blocks. The dispatcher
+  // cannot reach an excluded block either
+  if (entryBlock.getTerminator()->getNumSuccessors() > 1 ||
+      excluded.count(entryBlock.getTerminator()->getSuccessor(0))) {
     DEBUG(errs() << "\tSplitting entry block\n");
     initialBlock = SplitBlock(&entryBlock, entryBlock.getTerminator(), this);
     blocks.push_back(initialBlock);
@@ -200,74 +257,77 @@ bool Flatten::runOnFunction(Function &F) {
   DEBUG(entryBlock.setName("entry_block"));
   DEBUG(initialBlock->setName("initial_block"));
 
+  // Large functions are partitioned into clusters of consecutive blocks, each
+  // with its own dispatcher
+  unsigned numClusters = 1;
+  if (flattenMaxFanOut && blocks.size() > flattenMaxFanOut) {
+    numClusters = (blocks.size() + flattenMaxFanOut - 1) / flattenMaxFanOut;
+    DEBUG(errs() << "\tPartitioning into " << numClusters << " clusters\n");
+  }
+
+  if (!flattenSSA) {
+    // Demote all the PHI Nodes to stack
+    DEBUG(errs() << "\tDemoting PHI Nodes to stack\n");
+    for (auto block : blocks) {
+      std::vector<PHINode *> phis;
+      for (auto &inst : *block) {
+        if (PHINode *phiInst = dyn_cast<PHINode>(&inst)) {
+          phis.push_back(phiInst);
+        }
+      }
+      for (auto phiInst : phis) {
+        ObfUtils::demotePHI(phiInst);
+      }
+    }
+
+    // The jump block no longer separates definitions from their uses in other
+    // blocks. Demote them all in one pass
+    DEBUG(errs() << "\tDemoting values used across blocks\n");
+    demoteCrossBlockValues(F);
+  }
+
   entryBlock.getTerminator()->eraseFromParent();
 
+  // PHI nodes of flattened blocks are rebuilt once the CFG is final. Detach
+  // them now as their incoming blocks are about to become stale
+  std::vector<std::pair<PHINode *, BasicBlock *> > phis;
+  if (flattenSSA) {
+    for (auto block : blocks) {
+      while (PHINode *phi = dyn_cast<PHINode>(block->begin())) {
+        phi->removeFromParent();
+        phis.push_back(std::make_pair(phi, block));
+      }
+    }
+  }
+
   // Entry Block builder
   IRBuilder<> entryBuilder(&entryBlock);
 
-  BasicBlock *jumpBlock = BasicBlock::Create(context, "", &F);
-  jumpBlock->moveBefore(initialBlock);
-  DEBUG(jumpBlock->setName("jump_block"));
+  std::vector<Dispatcher> dispatchers;
+  dispatchers.reserve(numClusters);
+  DenseMap<BasicBlock *, unsigned> clusterOf, indices;
+  for (unsigned c = 0; c < numClusters; ++c) {
+    std::vector<BasicBlock *> targets(
+        blocks.begin() + blocks.size() * c / numClusters,
+        blocks.begin() + blocks.size() * (c + 1) / numClusters);
+    for (unsigned i = 0, iEnd = targets.size(); i < iEnd; ++i) {
+      clusterOf[targets[i]] = c;
+      indices[targets[i]] = i;
+    }
+    BasicBlock *insertBefore = numClusters == 1 ? initialBlock : targets[0];
+    dispatchers.push_back(createDispatcher(F, targets, insertBefore));
+  }
 
-  // Jump Block builder
-  IRBuilder<> jumpBuilder(jumpBlock);
+  // Dispatcher of the cluster a flattened block belongs to
+  auto dispatcherFor = [&](BasicBlock *block) -> Dispatcher &{
+    return dispatchers[clusterOf.lookup(block)];
+  };
 
-  Twine jumpIndexName("");
-  DEBUG(jumpIndexName = jumpIndexName.concat("jump_index"));
-  PHINode *jumpIndex = jumpBuilder.CreatePHI(Type::getInt32Ty(context),
-                                             blocks.size() + 1, jumpIndexName);
-
-  DEBUG(errs() << "\tCreating jump table:\n");
-  std::vector<Constant *> blockAddresses(blocks.size());
-
-  for (unsigned i = 0, iEnd = blocks.size(); i < iEnd; ++i) {
-    BasicBlock *block = blocks[i];
-    blockAddresses[i] = (Constant *)BlockAddress::get(block);
-  }
-  // Create JumpTables
-  DEBUG(errs() << "\tCreating jump table:\n");
-  ArrayType *jumpType =
-      ArrayType::get(Type::getInt8PtrTy(context), blocks.size());
-  Constant *jumpValues = ConstantArray::get(jumpType, blockAddresses);
-  Twine jumpTableName("");
-  DEBUG(jumpTableName = jumpTableName.concat(F.getName()).concat("_jumpTable"));
-  GlobalVariable *jumpTable = new GlobalVariable(
-      *(F.getParent()), jumpType, false, GlobalValue::PrivateLinkage,
-      jumpValues, jumpTableName);
-
-  Value *indices[2];
-  indices[0] = ConstantInt::get(Type::getInt32Ty(F.getContext()), 0, true);
-  indices[1] = jumpIndex;
-
-  // Create indirect branch
-  Twine jumpAddrPtrName("");
-  DEBUG(jumpAddrPtrName = jumpAddrPtrName.concat("jump_addr_ptr"));
-  Value *jumpAddressPtr =
-      jumpBuilder.CreateInBoundsGEP(jumpTable, indices, jumpAddrPtrName);
-  Twine jumpAddrName("");
-  DEBUG(jumpAddrName = jumpAddrName.concat("jump_addr"));
-  LoadInst *jumpAddr = jumpBuilder.CreateLoad(jumpAddressPtr, jumpAddrName);
-  IndirectBrInst *indirectBranch =
-      jumpBuilder.CreateIndirectBr(jumpAddr, blocks.size());
-  assert(indirectBranch && "IndirectBranchInst cannot be null!");
-
-  for (unsigned i = 0, iEnd = blocks.size(); i < iEnd; ++i) {
-    BasicBlock *block = blocks[i];
+  for (auto block : blocks) {
     assert(block != &entryBlock && "Entry block should not be processed!");
     DEBUG(errs() << "\t" << block->getName() << ":\n");
-    ConstantInt *index = ConstantInt::get(Type::getInt32Ty(context), i, false);
-
-    // Using switch for now
-    // switchInst->addCase(index, block);
-    indirectBranch->addDestination(block);
-
-    // Create jump index
-    if (block == initialBlock) {
-      jumpIndex->addIncoming(index, &entryBlock);
-    }
 
     TerminatorInst *terminator = block->getTerminator();
-    bool hasSuccessor = terminator->getNumSuccessors() > 0;
     if (terminator->getNumSuccessors() == 0) {
       // No need to do anything
       DEBUG(errs() << "\t\t0 Successor\n");
@@ -276,11 +336,16 @@ bool Flatten::runOnFunction(Function &F) {
       // Trivial
       DEBUG(errs() << "\t\t1 Successor\n");
       BasicBlock *destination = terminator->getSuccessor(0);
-      Value *destinationIndexValue = findBlock(context, blocks, destination);
-      jumpIndex->addIncoming(destinationIndexValue, block);
+      if (excluded.count(destination)) {
+        DEBUG(errs() << "\t\tSuccessor excluded -- keeping branch\n");
+      } else {
+        Dispatcher &target = dispatcherFor(destination);
+        Value *destinationIndexValue = findBlock(context, indices, destination);
+        target.index->addIncoming(destinationIndexValue, block);
 
-      terminator->eraseFromParent();
-      BranchInst::Create(jumpBlock, block);
+        terminator->eraseFromParent();
+        BranchInst::Create(target.block, block);
+      }
     } else { // > 1 succesors
       DEBUG(errs() << "\t\t" << terminator->getNumSuccessors()
                    << " Successors\n");
@@ -289,15 +354,47 @@ bool Flatten::runOnFunction(Function &F) {
         DEBUG(errs() << "\t\tConditional branch\n");
         BasicBlock *trueBlock = branch->getSuccessor(0);
         BasicBlock *falseBlock = branch->getSuccessor(1);
-        Value *trueIndex = findBlock(context, blocks, trueBlock);
-        Value *falseIndex = findBlock(context, blocks, falseBlock);
-        SelectInst *select = SelectInst::Create(
-            branch->getCondition(), trueIndex, falseIndex, "", terminator);
-
-        jumpIndex->addIncoming(select, block);
-
-        terminator->eraseFromParent();
-        BranchInst::Create(jumpBlock, block);
+        bool trueExcluded = excluded.count(trueBlock);
+        bool falseExcluded = excluded.count(falseBlock);
+        if (trueExcluded && falseExcluded) {
+          DEBUG(errs() << "\t\tSuccessors excluded -- keeping branch\n");
+        } else if (trueExcluded || falseExcluded) {
+          // Branch directly to the excluded successor only
+          DEBUG(errs() << "\t\tOne successor excluded\n");
+          BasicBlock *dispatched = trueExcluded ? falseBlock : trueBlock;
+          Dispatcher &target = dispatcherFor(dispatched);
+          target.index->addIncoming(
+              findBlock(context, indices, dispatched), block);
+          BranchInst::Create(trueExcluded ? trueBlock : target.block,
+                             trueExcluded ? target.block : falseBlock,
+                             branch->getCondition(), block);
+          terminator->eraseFromParent();
+        } else if (clusterOf.lookup(trueBlock) !=
+                   clusterOf.lookup(falseBlock)) {
+          // Hop straight to the dispatcher of each successor
+          DEBUG(errs() << "\t\tSuccessors in different clusters\n");
+          Dispatcher &trueTarget = dispatcherFor(trueBlock);
+          Dispatcher &falseTarget = dispatcherFor(falseBlock);
+          trueTarget.index->addIncoming(
+              findBlock(context, indices, trueBlock), block);
+          falseTarget.index->addIncoming(
+              findBlock(context, indices, falseBlock), block);
+          BranchInst::Create(trueTarget.block, falseTarget.block,
+                             branch->getCondition(), block);
+          terminator->eraseFromParent();
+          ++NumClusterHops;
+        } else {
+          Dispatcher &target = dispatcherFor(trueBlock);
+          Value *trueIndex = findBlock(context, indices, trueBlock);
+          Value *falseIndex = findBlock(context, indices, falseBlock);
+          SelectInst *select = SelectInst::Create(
+              branch->getCondition(), trueIndex, falseIndex, "", terminator);
+
+          target.index->addIncoming(select, block);
+
+          terminator->eraseFromParent();
+          BranchInst::Create(target.block, block);
+        }
 
 // Disabled because Invoke edges are not supported in promoting PHI
 #if 0
@@ -305,7 +402,7 @@ bool Flatten::runOnFunction(Function &F) {
           // InvokeInst
           DEBUG(errs() << "\t\tInvoke Terminator\n");
           Value *destination =
-              findBlock(context, blocks, invoke->getNormalDest());
+              findBlock(context, indices, invoke->getNormalDest());
           BasicBlock *newDestination = BasicBlock::Create(context, "", &F);
           invoke->setNormalDest(newDestination);
           jumpIndex->addIncoming(destination, newDestination);
@@ -331,49 +428,27 @@ bool Flatten::runOnFunction(Function &F) {
         phi->moveBefore(jumpBlock->begin());
       }
 #endif
+  }
 
-    if (hasSuccessor) {
-      DEBUG(errs() << "\t\tHandling successor use\n");
-      for (auto &inst : *block) {
-        DEBUG(errs() << "\t\t\t" << inst << "\n");
-        std::vector<User *> users;
-        PHINode *phi = nullptr;
-        bool isUsed = false;
-        // Find the phi node in jumpBlock if it's there
-        for (auto user = inst.use_begin(), useEnd = inst.use_end();
-             user != useEnd; ++user) {
-          Instruction *userInst = dyn_cast<Instruction>(*user);
-          assert(userInst && "User is not an instruction");
-          BasicBlock *userBlock = userInst->getParent();
-          if (userBlock == jumpBlock) {
-            phi = dyn_cast<PHINode>(userInst);
-            if (phi && phi != jumpIndex) {
-              isUsed = true;
-            }
-          } else if (userBlock != block) {
-            isUsed = true;
-            users.push_back(*user);
-            DEBUG(errs() << "\t\t\t\tUsed in " << userBlock->getName() << "\n");
-          }
-        }
-        if (isUsed && !phi) {
-          DEBUG(errs() << "\t\t\t\tCreating PHI Node\n");
-          phi = jumpBuilder.CreatePHI(inst.getType(), users.size(), "");
-          phi->moveBefore(jumpBlock->begin());
-        }
-        if (isUsed) {
-          if (phi->getBasicBlockIndex(block) == -1)
-            phi->addIncoming(&inst, block);
-          for (User *user : users) {
-            user->replaceUsesOfWith(&inst, phi);
-          }
-          DemotePHIToStack(phi);
-        }
-      }
+  Dispatcher &initialTarget = dispatcherFor(initialBlock);
+  initialTarget.index->addIncoming(
+      findBlock(context, indices, initialBlock), &entryBlock);
+  entryBuilder.CreateBr(initialTarget.block);
+
+  for (auto &dispatcher : dispatchers) {
+    if (ObfProfile::isGenerating())
+      ObfProfile::instrument(dispatcher.block, ObfProfile::FlattenSite);
+
+    if (flattenThreaded) {
+      DEBUG(errs() << "\tThreading dispatcher\n");
+      threadDispatch(dispatcher.block, dispatcher.index, blocks);
     }
   }
 
-  entryBuilder.CreateBr(jumpBlock);
+  if (flattenSSA) {
+    DEBUG(errs() << "\tRepairing SSA form\n");
+    repairSSA(F, phis);
+  }
 
 #if 0
   // Iterate through PHINodes of jumpBlock and assign NULL values or other
@@ -405,59 +480,268 @@ bool Flatten::runOnFunction(Function &F) {
   return true;
 }
 
-bool Flatten::isEligible(Function &F) {
-  DEBUG(errs() << "Flatten: Checking " << F.getName() << " eligibility:\n");
-  if (F.isDeclaration()) {
-    DEBUG(errs() << "\tIneligible -- declaration\n");
-    return false;
+void Flatten::getAnalysisUsage(AnalysisUsage &AU) const {
+  AU.addRequired<ObfuscationInfo>();
+  if (ObfUtils::HotnessFilter::isEnabled())
+    AU.addRequired<BlockFrequencyInfo>();
+  if (flattenKeepLoops)
+    AU.addRequired<LoopInfo>();
+}
+
+Flatten::Dispatcher Flatten::createDispatcher(
+    Function &F, std::vector<BasicBlock *> &targets, BasicBlock *insertBefore) {
+  LLVMContext &context = F.getContext();
+  Dispatcher dispatcher;
+  dispatcher.targets = targets;
+
+  BasicBlock *jumpBlock = BasicBlock::Create(context, "", &F);
+  jumpBlock->moveBefore(insertBefore);
+  DEBUG(jumpBlock->setName("jump_block"));
+  dispatcher.block = jumpBlock;
+  ++NumDispatchers;
+
+  // Jump Block builder
+  IRBuilder<> jumpBuilder(jumpBlock);
+
+  Twine jumpIndexName("");
+  DEBUG(jumpIndexName = jumpIndexName.concat("jump_index"));
+  Type *stateType = flattenDispatch == DirectDispatch
+                        ? Type::getInt8PtrTy(context)
+                        : Type::getInt32Ty(context);
+  PHINode *jumpIndex =
+      jumpBuilder.CreatePHI(stateType, targets.size() + 1, jumpIndexName);
+  dispatcher.index = jumpIndex;
+
+  IndirectBrInst *indirectBranch = nullptr;
+  switch (flattenDispatch) {
+  case TableDispatch: {
+    DEBUG(errs() << "\tCreating jump table:\n");
+    std::vector<Constant *> blockAddresses(targets.size());
+
+    for (unsigned i = 0, iEnd = targets.size(); i < iEnd; ++i) {
+      BasicBlock *block = targets[i];
+      blockAddresses[i] = (Constant *)BlockAddress::get(block);
+    }
+    // Create JumpTables
+    DEBUG(errs() << "\tCreating jump table:\n");
+    ArrayType *jumpType =
+        ArrayType::get(Type::getInt8PtrTy(context), targets.size());
+    Constant *jumpValues = ConstantArray::get(jumpType, blockAddresses);
+    Twine jumpTableName("");
+    DEBUG(jumpTableName =
+              jumpTableName.concat(F.getName()).concat("_jumpTable"));
+    GlobalVariable *jumpTable = new GlobalVariable(
+        *(F.getParent()), jumpType, true, GlobalValue::PrivateLinkage,
+        jumpValues, jumpTableName);
+
+    Value *indices[2];
+    indices[0] = ConstantInt::get(Type::getInt32Ty(F.getContext()), 0, true);
+    indices[1] = jumpIndex;
+
+    // Create indirect branch
+    Twine jumpAddrPtrName("");
+    DEBUG(jumpAddrPtrName = jumpAddrPtrName.concat("jump_addr_ptr"));
+    Value *jumpAddressPtr =
+        jumpBuilder.CreateInBoundsGEP(jumpTable, indices, jumpAddrPtrName);
+    Twine jumpAddrName("");
+    DEBUG(jumpAddrName = jumpAddrName.concat("jump_addr"));
+    LoadInst *jumpAddr = jumpBuilder.CreateLoad(jumpAddressPtr, jumpAddrName);
+    indirectBranch = jumpBuilder.CreateIndirectBr(jumpAddr, targets.size());
+    break;
   }
-  unsigned eligibleBB = 0;
-  DEBUG(errs() << "\tInspecting basic blocks\n");
-  BasicBlock &entryBlock = F.getEntryBlock();
-  for (auto &block : F) {
-    BasicBlock::iterator inst1 = block.begin();
-    if (block.getFirstNonPHIOrDbgOrLifetime()) {
-      inst1 = block.getFirstNonPHIOrDbgOrLifetime();
+  case RelativeDispatch: {
+    DEBUG(errs() << "\tCreating relative jump table\n");
+    Type *offsetType = Type::getInt32Ty(context);
+    Type *intPtrType = DataLayout(F.getParent()).getIntPtrType(context);
+    ArrayType *jumpType = ArrayType::get(offsetType, targets.size());
+    GlobalVariable *jumpTable =
+        new GlobalVariable(*(F.getParent()), jumpType, true,
+                           GlobalValue::PrivateLinkage, nullptr, "");
+    DEBUG(jumpTable->setName(F.getName() + "_jumpTable"));
+
+    // Entries are differences of labels in the function, which the assembler
+    // resolves. Unlike offsets from the table they need no relocations, so
+    // the table stays in .rodata even when compiling PIC
+    Constant *base =
+        ConstantExpr::getPtrToInt(BlockAddress::get(targets[0]), intPtrType);
+    std::vector<Constant *> offsets(targets.size());
+    for (unsigned i = 0, iEnd = targets.size(); i < iEnd; ++i) {
+      Constant *address =
+          ConstantExpr::getPtrToInt(BlockAddress::get(targets[i]), intPtrType);
+      offsets[i] = ConstantExpr::getTrunc(ConstantExpr::getSub(address, base),
+                                          offsetType);
     }
-
-    if (isa<IndirectBrInst>(block.getTerminator())) {
-      // TODO Maybe handle this
-      DEBUG(errs() << "\tIneligible function -- IndirectBrInst encountered\n");
-      return false;
+    jumpTable->setInitializer(ConstantArray::get(jumpType, offsets));
+
+    Value *indices[2];
+    indices[0] = ConstantInt::get(Type::getInt32Ty(context), 0, true);
+    indices[1] = jumpIndex;
+    Value *offsetPtr = jumpBuilder.CreateInBoundsGEP(jumpTable, indices);
+    Value *offset = jumpBuilder.CreateLoad(offsetPtr);
+    Value *address = jumpBuilder.CreateIntToPtr(
+        jumpBuilder.CreateAdd(jumpBuilder.CreateSExt(offset, intPtrType), base),
+        Type::getInt8PtrTy(context));
+    indirectBranch = jumpBuilder.CreateIndirectBr(address, targets.size());
+    break;
+  }
+  case SwitchDispatch: {
+    // The last block is reached through the default case
+    DEBUG(errs() << "\tCreating switch\n");
+    SwitchInst *switchInst = jumpBuilder.CreateSwitch(
+        jumpIndex, targets.back(), targets.size() - 1);
+    for (unsigned i = 0, iEnd = targets.size() - 1; i < iEnd; ++i) {
+      switchInst->addCase(ConstantInt::get(Type::getInt32Ty(context), i),
+                          targets[i]);
     }
+    break;
+  }
+  case DirectDispatch:
+    DEBUG(errs() << "\tCreating indirect branch\n");
+    indirectBranch = jumpBuilder.CreateIndirectBr(jumpIndex, targets.size());
+    break;
+  }
 
-    if (isa<SwitchInst>(block.getTerminator())) {
-      // TODO Maybe handle this
-      DEBUG(errs() << "\tIneligible function -- SwitchInst encountered\n");
-      return false;
+  if (indirectBranch) {
+    for (auto block : targets) {
+      indirectBranch->addDestination(block);
     }
+  }
+  return dispatcher;
+}
 
-    // LLVM does not support PHINodes for Invoke Edges
-    if (isa<InvokeInst>(block.getTerminator())) {
-      DEBUG(errs() << "\tIneligible function -- InvokeInst encountered\n");
-      return false;
+void Flatten::demoteCrossBlockValues(Function &F) {
+  BasicBlock *entryBlock = &F.getEntryBlock();
+  std::vector<Instruction *> demote;
+  for (auto &block : F) {
+    if (&block == entryBlock)
+      continue;
+    for (auto &inst : block) {
+      for (auto user = inst.use_begin(), useEnd = inst.use_end();
+           user != useEnd; ++user) {
+        Instruction *userInst = cast<Instruction>(*user);
+        if (userInst->getParent() != &block || isa<PHINode>(userInst)) {
+          demote.push_back(&inst);
+          break;
+        }
+      }
     }
+  }
+  DEBUG(errs() << "\tDemoting " << demote.size() << " values\n");
+  for (auto inst : demote) {
+    ObfUtils::demoteValue(inst);
+  }
+}
+
+void Flatten::threadDispatch(BasicBlock *jumpBlock, PHINode *jumpIndex,
+                             std::vector<BasicBlock *> &blocks) {
+  // Looking up and removing incoming values one block at a time is quadratic
+  // in the size of jumpIndex
+  DenseMap<BasicBlock *, Value *> states;
+  for (unsigned i = 0, iEnd = jumpIndex->getNumIncomingValues(); i < iEnd;
+       ++i) {
+    states[jumpIndex->getIncomingBlock(i)] = jumpIndex->getIncomingValue(i);
+  }
+  SmallPtrSet<BasicBlock *, 16> threaded;
 
-    if (block.isLandingPad()) {
+  for (auto block : blocks) {
+    BranchInst *branch = dyn_cast<BranchInst>(block->getTerminator());
+    if (!branch || branch->isConditional() ||
+        branch->getSuccessor(0) != jumpBlock) {
       continue;
     }
-    if (&block == &entryBlock) {
+    DEBUG(errs() << "\t\t" << block->getName() << "\n");
+
+    ValueToValueMapTy VMap;
+    VMap[jumpIndex] = states.lookup(block);
+    threaded.insert(block);
+    branch->eraseFromParent();
+
+    for (BasicBlock::iterator inst = jumpBlock->getFirstNonPHI(),
+                              instEnd = jumpBlock->end();
+         inst != instEnd; ++inst) {
+      Instruction *clone = inst->clone();
+      RemapInstruction(clone, VMap, RF_IgnoreMissingEntries);
+      block->getInstList().push_back(clone);
+      VMap[&*inst] = clone;
+    }
+    ++NumThreaded;
+  }
+
+  unsigned kept = 0;
+  for (unsigned i = 0, iEnd = jumpIndex->getNumIncomingValues(); i < iEnd;
+       ++i) {
+    BasicBlock *incoming = jumpIndex->getIncomingBlock(i);
+    if (threaded.count(incoming))
       continue;
+    jumpIndex->setIncomingValue(kept, jumpIndex->getIncomingValue(i));
+    jumpIndex->setIncomingBlock(kept, incoming);
+    ++kept;
+  }
+  // Removing from the back does not shift the remaining values
+  while (jumpIndex->getNumIncomingValues() > kept) {
+    jumpIndex->removeIncomingValue(jumpIndex->getNumIncomingValues() - 1,
+                                   false);
+  }
+}
+
+void Flatten::repairSSA(
+    Function &F, std::vector<std::pair<PHINode *, BasicBlock *> > &phis) {
+  // A PHI node is a value that becomes available at the end of each incoming
+  // block and is read at the start of its own block
+  for (auto &pair : phis) {
+    PHINode *phi = pair.first;
+    SSAUpdater SSA;
+    SSA.Initialize(phi->getType(), phi->getName());
+    for (unsigned i = 0, iEnd = phi->getNumIncomingValues(); i < iEnd; ++i) {
+      SSA.AddAvailableValue(phi->getIncomingBlock(i),
+                            phi->getIncomingValue(i));
     }
-    ++eligibleBB;
+    Value *value = SSA.GetValueInMiddleOfBlock(pair.second);
+    // Only possible if the PHI node never had any other incoming value
+    if (value == phi)
+      value = UndefValue::get(phi->getType());
+    phi->replaceAllUsesWith(value);
+    delete phi;
+    ++NumSSAValues;
   }
 
-  if (!eligibleBB) {
-    DEBUG(errs() << "\tIneligible function -- No eligible BB\n");
-    return false;
+  // Definitions no longer dominate their uses in other blocks. Values of the
+  // entry block still do
+  BasicBlock *entryBlock = &F.getEntryBlock();
+  std::vector<Instruction *> values;
+  for (auto &block : F) {
+    if (&block == entryBlock)
+      continue;
+    for (auto &inst : block) {
+      for (auto user = inst.use_begin(), useEnd = inst.use_end();
+           user != useEnd; ++user) {
+        Instruction *userInst = cast<Instruction>(*user);
+        if (userInst->getParent() != &block || isa<PHINode>(userInst)) {
+          values.push_back(&inst);
+          break;
+        }
+      }
+    }
   }
 
-  if (entryBlock.getTerminator()->getNumSuccessors() == eligibleBB ||
-      entryBlock.getTerminator()->getNumSuccessors() == 0) {
-    DEBUG(errs() << "\ttIneligible function -- already flat control flow\n");
-    return false;
+  for (auto inst : values) {
+    std::vector<Use *> uses;
+    for (auto user = inst->use_begin(), useEnd = inst->use_end();
+         user != useEnd; ++user) {
+      Instruction *userInst = cast<Instruction>(*user);
+      if (userInst->getParent() != inst->getParent() ||
+          isa<PHINode>(userInst)) {
+        uses.push_back(&user.getUse());
+      }
+    }
+    SSAUpdater SSA;
+    SSA.Initialize(inst->getType(), inst->getName());
+    SSA.AddAvailableValue(inst->getParent(), inst);
+    for (auto use : uses) {
+      SSA.RewriteUse(*use);
+    }
+    ++NumSSAValues;
   }
-  return true;
 }
 
 char Flatten::ID = 0;
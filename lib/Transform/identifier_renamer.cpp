@@ -62,6 +62,11 @@ bool IdentifierRenamer::runOnModule(Module &M) {
   return true;
 }
 
+// Only names change
+void IdentifierRenamer::getAnalysisUsage(AnalysisUsage &AU) const {
+  AU.setPreservesAll();
+}
+
 char IdentifierRenamer::ID = 0;
 static RegisterPass<IdentifierRenamer>
     X("identifier-renamer", "Remove identifiers and function names if possible",
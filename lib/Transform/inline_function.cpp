@@ -9,6 +9,8 @@
 #define DEBUG_TYPE "inline_function"
 #include "Transform/inline_function.h"
 #include "Transform/obf_utilities.h"
+#include "Transform/opaque_predicate.h"
+#include "Transform/policy.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Value.h"
@@ -23,7 +25,6 @@
 #include "llvm/Transforms/Utils/Cloning.h"
 #include <algorithm>
 #include <vector>
-#include <chrono>
 
 static cl::opt<double> inlineProbability(
     "inlineProbability", cl::init(0.2),
@@ -31,7 +32,7 @@ static cl::opt<double> inlineProbability(
 
 static cl::opt<std::string> inlineSeed(
     "inlineSeed", cl::init(""),
-    cl::desc("Seed for random number generator. Defaults to system time"));
+    cl::desc("Seed for random number generator. Defaults to -obf-seed"));
 
 static cl::opt<unsigned> inlinePass(
     "inlinePass", cl::init(2),
@@ -48,18 +49,6 @@ bool InlineFunctionPass::doInitialization(Module &M) {
     ctx.emitError("InlineFunctionPass: Probability must be between 0 and 1");
   }
 
-  // Seed engine and create distribution
-  if (!inlineSeed.empty()) {
-    std::seed_seq seed(inlineSeed.begin(), inlineSeed.end());
-    engine.seed(seed);
-  } else {
-    unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-    engine.seed(seed);
-  }
-
-  trial.param(
-      std::bernoulli_distribution::param_type((double)inlineProbability));
-
   return false;
 }
 
@@ -71,12 +60,20 @@ bool InlineFunctionPass::runOnFunction(Function &F) {
   if (F.isDeclaration()) {
     return false;
   }
-  if (inlineProbability == 0.f) {
+  if (!ObfPolicy::isAllowed(F, ObfPolicy::InlineTransform)) {
+    DEBUG(errs() << "InlineFunctionPass: Function '" << F.getName()
+                 << "' excluded by policy\n");
+    return false;
+  }
+  double probability = ObfPolicy::getProbability(F, inlineProbability);
+  if (probability == 0.0) {
     return false;
   }
 
   bool hasBeenModified = false;
   DEBUG(errs() << "InlineFunctionPass: Function '" << F.getName() << "'\n");
+  engine = ObfUtils::getEngine("inline", inlineSeed, F);
+  trial.param(std::bernoulli_distribution::param_type(probability));
 
   for (unsigned i = 0; i < inlinePass; ++i) {
     DEBUG(errs() << "\tPass " << i << ":\n");
@@ -105,7 +102,7 @@ bool InlineFunctionPass::runOnFunction(Function &F) {
 
     for (CallSite callsite : callsites) {
       DEBUG(errs() << "\t\t" << *(callsite.getInstruction()) << "\n");
-      if (inlineProbability != 1 && !trial(engine)) {
+      if (probability != 1.0 && !trial(engine)) {
         DEBUG(errs() << "\t\t\tSkipping: Bernoulli trial failed\n");
         continue;
       }
@@ -113,6 +110,9 @@ bool InlineFunctionPass::runOnFunction(Function &F) {
       bool inlined = InlineFunction(callsite, IFI);
 
       if (inlined) {
+        // The callee may have had stubs
+        if (!hasBeenModified)
+          OpaquePredicate::registerStubs(F);
         hasBeenModified |= true;
         DEBUG(errs() << "\t\t\tFunction call inlined\n");
       } else {
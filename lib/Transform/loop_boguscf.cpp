@@ -9,23 +9,66 @@
 #define DEBUG_TYPE "loop_boguscf"
 #include "Transform/loop_boguscf.h"
 #include "Transform/opaque_predicate.h"
+#include "Transform/policy.h"
+#include "Transform/profile.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/IR/Constants.h"
 #include "llvm/IR/Value.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/LLVMContext.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/CFG.h"
+#include "llvm/Transforms/Scalar.h"
 
 STATISTIC(NumLoops, "Number of loops inspected");
 STATISTIC(NumLoopsObf, "Number of loops obfuscated");
+STATISTIC(NumLoopsHot, "Number of hot loops excluded");
+STATISTIC(NumLoopsLong, "Number of loops excluded for their trip count");
+STATISTIC(NumLoopsNested, "Number of nested loops excluded");
+STATISTIC(NumLoopsPreheader, "Number of loops obfuscated in the preheader");
+STATISTIC(NumLoopsStrided, "Number of loops obfuscated with a stride");
+
+static cl::opt<std::string> loopBcfSeed(
+    "loopBcfSeed", cl::init(""),
+    cl::desc("Seed for random number generator. Defaults to -obf-seed"));
 
 static cl::opt<bool> disableLoopBcf(
     "disableLoopBcf", cl::init(false),
     cl::desc(
         "Disable Loop BCF pass regardless. Useful when used in -OX mode."));
 
+static cl::opt<LoopBogusCF::Placement> loopBcfPlacement(
+    "loopBcfPlacement", cl::init(LoopBogusCF::AutoPlacement),
+    cl::desc("Where the opaque predicate of a loop goes:"),
+    cl::values(clEnumValN(LoopBogusCF::HeaderPlacement, "header",
+                          "Loop header, every iteration"),
+               clEnumValN(LoopBogusCF::PreheaderPlacement, "preheader",
+                          "In front of the loop"),
+               clEnumValN(LoopBogusCF::OuterPlacement, "outer",
+                          "Loop header of outermost loops only"),
+               clEnumValN(LoopBogusCF::StridedPlacement, "strided",
+                          "Loop header, every -loopBcfStride iterations"),
+               clEnumValN(LoopBogusCF::AutoPlacement, "auto",
+                          "Header for loops with a known trip count, "
+                          "skipping those above -loopBcfMaxTripCount, "
+                          "preheader for other innermost loops, strided "
+                          "otherwise (default)"),
+               clEnumValEnd));
+
+static cl::opt<unsigned> loopBcfMaxTripCount(
+    "loopBcfMaxTripCount", cl::init(1000),
+    cl::desc("Largest estimated trip count of a loop with a predicate on "
+             "every iteration. Longer loops are skipped. 0 for no limit"));
+
+static cl::opt<unsigned> loopBcfStride(
+    "loopBcfStride", cl::init(64),
+    cl::desc("Iterations between evaluations of strided predicates. Must be "
+             "a power of two"));
+
 bool LoopBogusCF::runOnLoop(Loop *loop, LPPassManager &LPM) {
   if (disableLoopBcf)
     return false;
@@ -59,38 +102,261 @@ bool LoopBogusCF::runOnLoop(Loop *loop, LPPassManager &LPM) {
     return false;
   }
 
+  Function *F = header->getParent();
+  if (F != engineFunction) {
+    engine = ObfUtils::getEngine("loop-boguscf", loopBcfSeed, *F);
+    engineFunction = F;
+  }
+
+  if (ObfPolicy::governs(*F)) {
+    if (!ObfPolicy::isAllowed(*F, ObfPolicy::LoopBogusCFTransform)) {
+      DEBUG(errs() << "\t Excluded by policy -- skipping\n");
+      return false;
+    }
+    // The intensity is the probability of obfuscating each loop
+    std::bernoulli_distribution policyTrial(
+        ObfPolicy::getProbability(*F, 1.0));
+    if (!policyTrial(engine)) {
+      DEBUG(errs() << "\t Bernoulli trial failed -- skipping\n");
+      return false;
+    }
+  }
+
+  if (ObfUtils::HotnessFilter::isEnabled()) {
+    // Frequencies are computed once per function, before any header is split
+    if (F != hotnessFunction) {
+      hotness.reset(
+          new ObfUtils::HotnessFilter(*F, getAnalysis<BlockFrequencyInfo>()));
+      hotnessFunction = F;
+    }
+    if (hotness->isHot(header)) {
+      std::bernoulli_distribution hotTrial(hotness->weight(header));
+      if (!hotTrial(engine)) {
+        DEBUG(errs() << "\t Hot loop -- skipping\n");
+        hotness->reportExcluded("loop-boguscf", header);
+        ++NumLoopsHot;
+        return false;
+      }
+    }
+  }
+
+  if (!ObfProfile::isAllowed(*header->getParent(),
+                            ObfProfile::LoopBogusCFSite)) {
+    DEBUG(errs() << "\t Over overhead budget -- skipping\n");
+    return false;
+  }
+
+  Placement placement = loopBcfPlacement;
+  uint64_t tripCount = getTripCount(loop, getAnalysis<ScalarEvolution>());
+  DEBUG(errs() << "\t Trip count " << tripCount << ", depth "
+               << loop->getLoopDepth() << "\n");
+  if (placement == AutoPlacement)
+    placement = choosePlacement(loop, tripCount);
+
+  if (placement == OuterPlacement) {
+    if (loop->getParentLoop()) {
+      DEBUG(errs() << "\t Nested loop -- skipping\n");
+      ++NumLoopsNested;
+      return false;
+    }
+    placement = HeaderPlacement;
+  }
+
+  if (placement == HeaderPlacement && loopBcfMaxTripCount &&
+      tripCount > loopBcfMaxTripCount) {
+    DEBUG(errs() << "\t Trip count too large -- skipping\n");
+    ++NumLoopsLong;
+    return false;
+  }
+
+  if (placement == StridedPlacement &&
+      (!loopBcfStride || (loopBcfStride & (loopBcfStride - 1)))) {
+    LLVMContext &ctx = getGlobalContext();
+    ctx.emitError("LoopBogusCF: loopBcfStride must be a power of two");
+    return false;
+  }
+
   ++NumLoopsObf;
   // DEBUG(header->getParent()->viewCFG());
 
-  DEBUG(errs() << "\tCreating dummy block\n");
   LoopInfo &info = getAnalysis<LoopInfo>();
-  // Split header block
-  BasicBlock *dummy = header->splitBasicBlock(header->getTerminator());
-  loop->addBasicBlockToLoop(dummy, info.getBase());
+  DominatorTree *DT = getAnalysisIfAvailable<DominatorTree>();
+  switch (placement) {
+  case PreheaderPlacement:
+    ++NumLoopsPreheader;
+    obfuscatePreheader(loop, info, DT);
+    break;
+  case StridedPlacement:
+    ++NumLoopsStrided;
+    obfuscateHeader(loop, branch, exitBlock, loopBcfStride, info, DT);
+    break;
+  default:
+    obfuscateHeader(loop, branch, exitBlock, 0, info, DT);
+    break;
+  }
+  // The loop has a new exiting block
+  getAnalysis<ScalarEvolution>().forgetLoop(loop);
 
-  BasicBlock *trueBlock, *falseBlock = exitBlock;
+  // DEBUG(header->getParent()->viewCFG());
 
-  if (branch->getSuccessor(0) == exitBlock) {
-    trueBlock = branch->getSuccessor(1);
-    branch->setSuccessor(1, dummy);
-  } else {
-    trueBlock = branch->getSuccessor(0);
-    branch->setSuccessor(0, dummy);
+  return true;
+}
+
+uint64_t LoopBogusCF::getTripCount(Loop *loop, ScalarEvolution &SE) {
+  const SCEV *count = SE.getMaxBackedgeTakenCount(loop);
+  if (const SCEVConstant *constant = dyn_cast<SCEVConstant>(count)) {
+    // Wraps around to 0 (unknown) for the largest count
+    return constant->getValue()->getValue().getLimitedValue() + 1;
   }
+  return 0;
+}
+
+LoopBogusCF::Placement LoopBogusCF::choosePlacement(Loop *loop,
+                                                    uint64_t tripCount) {
+  // Loops known to run too long are skipped like with header placement
+  if (tripCount)
+    return HeaderPlacement;
+  // Entered once per iteration of the enclosing loop at most
+  if (loop->empty())
+    return PreheaderPlacement;
+  return StridedPlacement;
+}
+
+void LoopBogusCF::obfuscateHeader(Loop *loop, BranchInst *branch,
+                                  BasicBlock *exitBlock, unsigned stride,
+                                  LoopInfo &info, DominatorTree *DT) {
+  BasicBlock *header = loop->getHeader();
+  DEBUG(errs() << "\tCreating dummy block\n");
+  // Split header block. The header only dominated the body and the exit
+  // block, which it still dominates
+  BasicBlock *dummy =
+      ObfUtils::splitBlock(header, header->getTerminator(), DT, &info);
+  if (DT)
+    DT->changeImmediateDominator(exitBlock, header);
+
+  BasicBlock *trueBlock, *falseBlock = exitBlock;
+  unsigned bodyIndex = branch->getSuccessor(0) == exitBlock ? 1 : 0;
+  trueBlock = branch->getSuccessor(bodyIndex);
+  branch->setSuccessor(bodyIndex, dummy);
 
   branch->moveBefore(header->getTerminator());
   header->getTerminator()->eraseFromParent();
 
+  // Splitting moved the incoming values of the exit block over to dummy. They
+  // still come from the header, while the edge from dummy is never taken
+  for (auto &inst : *exitBlock) {
+    PHINode *phi = dyn_cast<PHINode>(&inst);
+    if (!phi)
+      break;
+    int index = phi->getBasicBlockIndex(dummy);
+    if (index < 0)
+      continue;
+    phi->setIncomingBlock(index, header);
+    phi->addIncoming(UndefValue::get(phi->getType()), dummy);
+  }
+
+  LLVMContext &context = header->getContext();
+  if (stride && trueBlock == header) {
+    // The gate and dummy both branch back to the header of a single block
+    // loop. They share a new latch so that the loop keeps a single one
+    BasicBlock *latch = BasicBlock::Create(context, "", header->getParent());
+    latch->moveAfter(dummy);
+    BranchInst::Create(header, latch);
+    loop->addBasicBlockToLoop(latch, info.getBase());
+    if (DT)
+      DT->addNewBlock(latch, dummy);
+    for (auto &inst : *header) {
+      PHINode *phi = dyn_cast<PHINode>(&inst);
+      if (!phi)
+        break;
+      int index = phi->getBasicBlockIndex(dummy);
+      if (index >= 0)
+        phi->setIncomingBlock(index, latch);
+    }
+    trueBlock = latch;
+  }
+
   OpaquePredicate::createStub(dummy, trueBlock, falseBlock,
                               OpaquePredicate::PredicateTrue, false);
 
-  // DEBUG(header->getParent()->viewCFG());
+  if (!stride)
+    return;
 
-  return true;
+  // Only go through dummy when the iteration counter is a multiple of stride
+  BasicBlock *gate =
+      BasicBlock::Create(context, "", header->getParent(), dummy);
+  loop->addBasicBlockToLoop(gate, info.getBase());
+  branch->setSuccessor(bodyIndex, gate);
+  if (DT) {
+    DT->addNewBlock(gate, header);
+    DT->changeImmediateDominator(dummy, gate);
+    if (DT->getNode(trueBlock)->getIDom()->getBlock() == dummy)
+      DT->changeImmediateDominator(trueBlock, gate);
+  }
+  for (auto &inst : *trueBlock) {
+    PHINode *phi = dyn_cast<PHINode>(&inst);
+    if (!phi)
+      break;
+    int index = phi->getBasicBlockIndex(dummy);
+    if (index >= 0)
+      phi->addIncoming(phi->getIncomingValue(index), gate);
+  }
+
+  Type *intType = Type::getInt32Ty(context);
+  PHINode *counter = PHINode::Create(intType, 2, "", header->begin());
+  Value *next = BinaryOperator::CreateAdd(
+      counter, ConstantInt::get(intType, 1), "", branch);
+  for (pred_iterator it = pred_begin(header), end = pred_end(header);
+       it != end; ++it) {
+    BasicBlock *predecessor = *it;
+    counter->addIncoming(loop->contains(predecessor)
+                             ? next
+                             : ConstantInt::get(intType, 0),
+                         predecessor);
+  }
+
+  Value *masked = BinaryOperator::CreateAnd(
+      counter, ConstantInt::get(intType, stride - 1), "", gate);
+  Value *check = new ICmpInst(*gate, ICmpInst::ICMP_EQ, masked,
+                              ConstantInt::get(intType, 0));
+  BranchInst::Create(dummy, trueBlock, check, gate);
+}
+
+void LoopBogusCF::obfuscatePreheader(Loop *loop, LoopInfo &info,
+                                     DominatorTree *DT) {
+  BasicBlock *preheader = loop->getLoopPreheader();
+  DEBUG(errs() << "\tCreating dummy block in preheader\n");
+  // preheader -> dummy -> entry -> header, where entry is the new preheader
+  BasicBlock *dummy =
+      ObfUtils::splitBlock(preheader, preheader->getTerminator(), DT, &info);
+  BasicBlock *entry =
+      ObfUtils::splitBlock(dummy, dummy->getTerminator(), DT, &info);
+
+  // Never taken. Filled with junk once it is marked unreachable
+  BasicBlock *decoy = BasicBlock::Create(preheader->getContext(), "",
+                                         preheader->getParent(), entry);
+  BranchInst::Create(entry, decoy);
+  if (DT)
+    DT->addNewBlock(decoy, dummy);
+  if (Loop *parent = loop->getParentLoop())
+    parent->addBasicBlockToLoop(decoy, info.getBase());
+
+  OpaquePredicate::createStub(dummy, entry, decoy,
+                              OpaquePredicate::PredicateTrue);
 }
 
 void LoopBogusCF::getAnalysisUsage(AnalysisUsage &AU) const {
   AU.addRequired<LoopInfo>();
+  AU.addRequired<ScalarEvolution>();
+  if (ObfUtils::HotnessFilter::isEnabled())
+    AU.addRequired<BlockFrequencyInfo>();
+  // New blocks are added to the dominator tree and their loops. Loops keep
+  // their single preheader and latch and their dedicated exits
+  AU.addPreserved<DominatorTree>();
+  AU.addPreserved<LoopInfo>();
+  AU.addPreserved<ScalarEvolution>();
+  AU.addPreservedID(LoopSimplifyID);
+  AU.addPreservedID(LCSSAID);
 }
 
 char LoopBogusCF::ID = 0;
@@ -12,10 +12,39 @@
 #include "Transform/obf_utilities.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/Support/ValueHandle.h"
+#include "llvm/Transforms/Utils/Local.h"
 #include "llvm/Transforms/Utils/PromoteMemToReg.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
 #include <vector>
 
+static cl::opt<std::string> obfSeed(
+    "obf-seed", cl::init(""),
+    cl::desc("Master seed for the random number generators of every "
+             "obfuscation pass. Pass specific seeds take precedence"));
+
+static cl::opt<bool> obfHotness(
+    "obf-hotness", cl::init(false),
+    cl::desc("Use block frequencies to keep BogusCF, Flatten, LoopBogusCF and "
+             "expensive opaque predicates away from hot blocks"));
+
+static cl::opt<double> obfHotPercentile(
+    "obf-hot-percentile", cl::init(0.9),
+    cl::desc("Blocks at or above this frequency percentile of their function "
+             "are considered hot. Defaults to 0.9"));
+
+static cl::opt<double> obfHotWeight(
+    "obf-hot-weight", cl::init(0.0),
+    cl::desc("Probability multiplier applied to hot blocks. 0 excludes them "
+             "entirely. Defaults to 0"));
+
+static cl::opt<bool>
+    obfHotReport("obf-hot-report", cl::init(false),
+                 cl::desc("Report hot blocks excluded from obfuscation"));
+
 namespace {
 StringRef getMetaKindName(ObfUtils::ObfType type) {
   switch (type) {
@@ -32,11 +61,52 @@ StringRef getMetaKindName(ObfUtils::ObfType type) {
 };
 
 namespace ObfUtils {
+namespace {
+// Slots created by demotePHI and demoteValue, until they are promoted
+DenseMap<Function *, std::vector<WeakVH> > demotedSlots;
+
+// FNV-1a, terminated so that consecutive strings cannot run into each other
+uint64_t hashString(uint64_t hash, StringRef data) {
+  for (char c : data) {
+    hash ^= (unsigned char)c;
+    hash *= 0x100000001b3ULL;
+  }
+  hash ^= 0xFF;
+  hash *= 0x100000001b3ULL;
+  return hash;
+}
+
+RandomEngine createEngine(StringRef pass, StringRef passSeed, const Module &M,
+                          StringRef function) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  hash = hashString(hash, passSeed.empty() ? StringRef(obfSeed) : passSeed);
+  hash = hashString(hash, pass);
+  hash = hashString(hash, M.getModuleIdentifier());
+  hash = hashString(hash, function);
+  DEBUG(errs() << "RandomEngine: " << pass << " " << function << " "
+               << hash << "\n");
+  std::seed_seq seed{ (uint32_t)hash, (uint32_t)(hash >> 32) };
+  return RandomEngine(seed);
+}
+};
+
+RandomEngine getEngine(StringRef pass, StringRef passSeed, const Module &M) {
+  return createEngine(pass, passSeed, M, "");
+}
+
+RandomEngine getEngine(StringRef pass, StringRef passSeed,
+                       const Function &F) {
+  return createEngine(pass, passSeed, *F.getParent(), F.getName());
+}
+
+unsigned getMetaKind(LLVMContext &context, ObfType type) {
+  return context.getMDKindID(getMetaKindName(type));
+}
+
 void tagFunction(Function &F, ObfType type, ArrayRef<Value *> values) {
   LLVMContext &context = F.getContext();
-  StringRef metaKindName = getMetaKindName(type);
   MDNode *metaNode = MDNode::get(context, values);
-  unsigned metaKind = context.getMDKindID(metaKindName);
+  unsigned metaKind = getMetaKind(context, type);
 
   // Get first instruction
   Instruction *first = (Instruction *)(F.getEntryBlock().begin());
@@ -51,35 +121,110 @@ void tagFunction(Function &F, ObfType type) {
 
 // Check if a function has been tagged as obfuscated of type
 MDNode *checkFunctionTagged(Function &F, ObfType type) {
-  LLVMContext &context = F.getContext();
-  StringRef metaKindName = getMetaKindName(type);
-  unsigned metaKind = context.getMDKindID(metaKindName);
+  return checkFunctionTagged(F, getMetaKind(F.getContext(), type));
+}
+
+MDNode *checkFunctionTagged(Function &F, unsigned metaKind) {
   // Get first instruction
   Instruction *first = (Instruction *)(F.getEntryBlock().begin());
   return first->getMetadata(metaKind);
 }
 
-void promoteAllocas(Function &F, DominatorTree &DT) {
-  DEBUG(errs() << "PromoteAllocas: Function " << F.getName() << "\n");
-  std::vector<AllocaInst *> allocas;
-  for (auto &block : F) {
-    for (Instruction &inst : block) {
-      if (AllocaInst *alloca = dyn_cast<AllocaInst>(&inst)) {
-        if (isAllocaPromotable(alloca)) {
-          allocas.push_back(alloca);
-        }
-      }
+AllocaInst *demotePHI(PHINode *phi) {
+  Function *F = phi->getParent()->getParent();
+  AllocaInst *slot = DemotePHIToStack(phi);
+  demotedSlots[F].push_back(slot);
+  return slot;
+}
+
+AllocaInst *demoteValue(Instruction *inst) {
+  Function *F = inst->getParent()->getParent();
+  AllocaInst *slot = DemoteRegToStack(*inst);
+  demotedSlots[F].push_back(slot);
+  return slot;
+}
+
+void promoteAllocas(ArrayRef<AllocaInst *> allocas, DominatorTree &DT) {
+  std::vector<AllocaInst *> promotable;
+  for (auto alloca : allocas) {
+    if (isAllocaPromotable(alloca))
+      promotable.push_back(alloca);
+  }
+  DEBUG(errs() << "PromoteAllocas: Promoting " << promotable.size() << " of "
+               << allocas.size() << " allocas\n");
+  if (!promotable.empty())
+    PromoteMemToReg(promotable, DT);
+}
+
+BasicBlock *splitBlock(BasicBlock *block, Instruction *splitPt,
+                       DominatorTree *DT, LoopInfo *LI) {
+  BasicBlock *newBlock = block->splitBasicBlock(splitPt);
+  if (LI) {
+    if (Loop *loop = LI->getLoopFor(block))
+      loop->addBasicBlockToLoop(newBlock, LI->getBase());
+  }
+  if (DT) {
+    // Unreachable blocks are not in the tree
+    if (DomTreeNode *node = DT->getNode(block)) {
+      std::vector<DomTreeNode *> children(node->begin(), node->end());
+      DomTreeNode *newNode = DT->addNewBlock(newBlock, block);
+      for (auto child : children)
+        DT->changeImmediateDominator(child, newNode);
     }
   }
-  DEBUG(errs() << "\tPromoting " << allocas.size() << " allocas\n");
-  DT.getBase().recalculate(F);
-  PromoteMemToReg(allocas, DT);
+  return newBlock;
+}
+
+bool promoteDemoted(Function &F, DominatorTree *DT) {
+  auto found = demotedSlots.find(&F);
+  if (found == demotedSlots.end())
+    return false;
+  std::vector<AllocaInst *> allocas;
+  for (auto &handle : found->second) {
+    // Slots may have been deleted or promoted since
+    Value *value = handle;
+    AllocaInst *alloca = dyn_cast_or_null<AllocaInst>(value);
+    if (alloca && alloca->getParent() &&
+        alloca->getParent()->getParent() == &F)
+      allocas.push_back(alloca);
+  }
+  demotedSlots.erase(found);
+  if (allocas.empty())
+    return false;
+
+  DEBUG(errs() << "PromoteDemoted: Function " << F.getName() << "\n");
+  if (DT) {
+    promoteAllocas(allocas, *DT);
+    return true;
+  }
+  DominatorTree localDT;
+  localDT.runOnFunction(F);
+  promoteAllocas(allocas, localDT);
+  return true;
+}
+
+void clearDemoted(Module &M) {
+  for (auto &F : M)
+    demotedSlots.erase(&F);
+  // Functions deleted since their values were demoted took the slots along.
+  // Their entries must not be picked up by a function reusing the address
+  std::vector<Function *> dead;
+  for (auto &entry : demotedSlots) {
+    bool live = false;
+    for (auto &handle : entry.second)
+      live |= (Value *)handle != nullptr;
+    if (!live)
+      dead.push_back(entry.first);
+  }
+  for (auto F : dead)
+    demotedSlots.erase(F);
 }
 
 bool removeTagIfExists(Instruction &I, ObfType type) {
-  LLVMContext &context = I.getContext();
-  StringRef metaKindName = getMetaKindName(type);
-  unsigned metaKind = context.getMDKindID(metaKindName);
+  return removeTagIfExists(I, getMetaKind(I.getContext(), type));
+}
+
+bool removeTagIfExists(Instruction &I, unsigned metaKind) {
   if (I.getMetadata(metaKind)) {
     I.setMetadata(metaKind, nullptr);
     return true;
@@ -87,4 +232,79 @@ bool removeTagIfExists(Instruction &I, ObfType type) {
     return false;
   }
 }
+
+HotnessFilter::HotnessFilter(Function &F, BlockFrequencyInfo &BFI)
+    : threshold(0), entryFrequency(0), coldFunction(false) {
+  if (obfHotPercentile < 0.f || obfHotPercentile > 1.f) {
+    LLVMContext &ctx = getGlobalContext();
+    ctx.emitError("obf-hot-percentile must be between 0 and 1");
+  }
+  if (obfHotWeight < 0.f || obfHotWeight > 1.f) {
+    LLVMContext &ctx = getGlobalContext();
+    ctx.emitError("obf-hot-weight must be between 0 and 1");
+  }
+
+  if (F.isDeclaration() || F.hasFnAttribute(Attribute::Cold)) {
+    coldFunction = true;
+    return;
+  }
+
+  std::vector<uint64_t> sorted;
+  sorted.reserve(F.size());
+  for (auto &block : F) {
+    bool cold = isa<UnreachableInst>(block.getTerminator());
+    for (auto &inst : block) {
+      if (CallInst *call = dyn_cast<CallInst>(&inst)) {
+        if (call->doesNotReturn() || call->hasFnAttr(Attribute::Cold)) {
+          cold = true;
+          break;
+        }
+      }
+    }
+    uint64_t frequency = BFI.getBlockFreq(&block).getFrequency();
+    sorted.push_back(frequency);
+    // Cold blocks still take part in the percentile but are never hot
+    if (!cold)
+      frequencies[&block] = frequency;
+  }
+
+  std::sort(sorted.begin(), sorted.end());
+  threshold = sorted[(size_t)(obfHotPercentile * (sorted.size() - 1))];
+  entryFrequency = BFI.getBlockFreq(&F.getEntryBlock()).getFrequency();
+  DEBUG(errs() << "HotnessFilter: Function " << F.getName() << " threshold "
+               << threshold << ", entry " << entryFrequency << "\n");
+}
+
+bool HotnessFilter::isEnabled() { return obfHotness; }
+
+bool HotnessFilter::isHot(const BasicBlock *block) const {
+  if (coldFunction)
+    return false;
+  auto frequency = frequencies.find(block);
+  if (frequency == frequencies.end())
+    return false;
+  // Straight line code runs as often as the entry block and is never hot
+  return frequency->second >= threshold && frequency->second > entryFrequency;
+}
+
+double HotnessFilter::weight(const BasicBlock *block) const {
+  return isHot(block) ? (double)obfHotWeight : 1.0;
+}
+
+void HotnessFilter::reportExcluded(StringRef pass,
+                                   const BasicBlock *block) const {
+  if (!obfHotReport)
+    return;
+  const Function *F = block->getParent();
+  auto frequency = frequencies.find(block);
+  errs() << pass << ": excluded hot block '" << block->getName() << "' in '"
+         << F->getName() << "' (frequency "
+         << (frequency == frequencies.end() ? 0 : frequency->second)
+         << ", threshold " << threshold << ")\n";
+}
 };
+
+char PromoteDemoted::ID = 0;
+static RegisterPass<PromoteDemoted>
+    X("promote-demoted", "Promote the values demoted by obfuscation passes",
+      false, false);
@@ -0,0 +1,73 @@
+//=== obfuscation_info.cpp - Facts shared by the obfuscation passes -------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+#define DEBUG_TYPE "obfuscation-info"
+#include "Transform/obfuscation_info.h"
+#include "Transform/copy.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+
+bool ObfuscationInfo::runOnFunction(Function &F) {
+  bogusCFBlocks.clear();
+  flattenBlocks.clear();
+  bogusCFEligible = false;
+  flattenEligible = false;
+  copyTag = ObfUtils::NoneObf;
+  if (F.isDeclaration())
+    return false;
+
+  DEBUG(errs() << "ObfuscationInfo: Function '" << F.getName() << "'\n");
+  if (Copy::isFunctionTagged(F, ObfUtils::BogusCFObf))
+    copyTag = ObfUtils::BogusCFObf;
+  else if (Copy::isFunctionTagged(F, ObfUtils::FlattenObf))
+    copyTag = ObfUtils::FlattenObf;
+
+  // BogusCF cannot demote PHI nodes on invoke edges. Flatten cannot handle
+  // invokes either, nor switches and indirect branches
+  bool bogusCFUnsupported = false;
+  bool flattenUnsupported = false;
+  BasicBlock &entryBlock = F.getEntryBlock();
+  for (auto &block : F) {
+    TerminatorInst *terminator = block.getTerminator();
+    if (isa<IndirectBrInst>(terminator) || isa<SwitchInst>(terminator) ||
+        isa<InvokeInst>(terminator))
+      flattenUnsupported = true;
+
+    if (&block == &entryBlock || block.isLandingPad())
+      continue;
+    flattenBlocks.push_back(&block);
+
+    BasicBlock::iterator inst1 = block.begin();
+    if (block.getFirstNonPHIOrDbgOrLifetime()) {
+      inst1 = block.getFirstNonPHIOrDbgOrLifetime();
+    }
+    if (isa<TerminatorInst>(inst1))
+      continue;
+    if (isa<InvokeInst>(terminator))
+      bogusCFUnsupported = true;
+    bogusCFBlocks.push_back(&block);
+  }
+
+  bogusCFEligible = !bogusCFUnsupported && !bogusCFBlocks.empty();
+  // Already flat if the entry block branches to every other block
+  unsigned entrySuccessors = entryBlock.getTerminator()->getNumSuccessors();
+  flattenEligible = !flattenUnsupported && !flattenBlocks.empty() &&
+                    entrySuccessors != flattenBlocks.size() &&
+                    entrySuccessors != 0;
+  DEBUG(errs() << "\t" << bogusCFBlocks.size() << " BogusCF blocks, "
+               << (bogusCFEligible ? "eligible" : "ineligible") << "\n");
+  DEBUG(errs() << "\t" << flattenBlocks.size() << " Flatten blocks, "
+               << (flattenEligible ? "eligible" : "ineligible") << "\n");
+  return false;
+}
+
+char ObfuscationInfo::ID = 0;
+static RegisterPass<ObfuscationInfo>
+    X("obfuscation-info", "Blocks and functions eligible for obfuscation",
+      true, true);
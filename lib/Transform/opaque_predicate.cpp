@@ -12,14 +12,24 @@
 
 #define DEBUG_TYPE "opaque"
 #include "Transform/opaque_predicate.h"
+#include "Transform/obf_utilities.h"
+#include "Transform/profile.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Support/ValueHandle.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/CommandLine.h"
-#include <chrono>
+#include <memory>
 #include <random>
 #include <cassert>
 using namespace llvm;
@@ -30,46 +40,162 @@ static cl::opt<unsigned> opaqueGlobal(
 
 static cl::opt<std::string> opaqueSeed(
     "opaque-seed", cl::init(""),
-    cl::desc("Seed for random number generator. Defaults to system time"));
+    cl::desc("Seed for random number generator. Defaults to -obf-seed"));
 
 static cl::opt<bool> disableOpaquePred(
     "disableOpaquePred", cl::init(false),
     cl::desc("Disable Opaque Predicate pass regardless. Useful when used in -OX mode."));
 
+static cl::opt<OpaquePredicate::FormulaCost> opaqueMaxCost(
+    "opaque-max-cost", cl::init(OpaquePredicate::ExpensiveFormula),
+    cl::desc("Most expensive formulae used for opaque predicates. Hot blocks "
+             "only get cheap ones with -obf-hotness:"),
+    cl::values(clEnumValN(OpaquePredicate::CheapFormula, "cheap",
+                          "Native width arithmetic only"),
+               clEnumValN(OpaquePredicate::MediumFormula, "medium",
+                          "Up to 64 bit multiplication and division"),
+               clEnumValN(OpaquePredicate::ExpensiveFormula, "expensive",
+                          "Any formula (default)"),
+               clEnumValEnd));
+
+static cl::opt<OpaquePredicate::StateStorage> opaqueState(
+    "opaque-state", cl::init(OpaquePredicate::SharedState),
+    cl::desc("Storage of the globals advanced by opaque predicates:"),
+    cl::values(clEnumValN(OpaquePredicate::SharedState, "shared",
+                          "Globals shared by all threads (default)"),
+               clEnumValN(OpaquePredicate::PaddedState, "padded",
+                          "Shared globals on separate cache lines"),
+               clEnumValN(OpaquePredicate::ThreadLocalState, "thread-local",
+                          "Thread local globals"),
+               clEnumValEnd));
+
+// Size and alignment that keep padded globals on separate cache lines
+static const unsigned cacheLineSize = 64;
+
+static cl::opt<int> opaqueFormula(
+    "opaque-formula", cl::init(-1), cl::Hidden,
+    cl::desc("Always use this formula. For benchmarking"));
+
+static cl::opt<bool> opaqueBranchWeights(
+    "opaque-branch-weights", cl::init(true),
+    cl::desc("Attach branch weights to opaque predicates and move their never "
+             "taken successors to the end of the function"));
+
+static cl::opt<OpaquePredicate::PredicateSource> opaqueSource(
+    "opaque-source", cl::init(OpaquePredicate::GlobalSource),
+    cl::desc("Operands of opaque predicates:"),
+    cl::values(clEnumValN(OpaquePredicate::GlobalSource, "global",
+                          "Globals advanced by every predicate (default)"),
+               clEnumValN(OpaquePredicate::LiveSource, "live",
+                          "Integer values live at the predicate. Needs no "
+                          "memory operations"),
+               clEnumValEnd));
+
+static cl::opt<bool> opaqueHoistState(
+    "opaque-hoist-state", cl::init(false),
+    cl::desc("Keep the opaque predicate state of a function in registers. It "
+             "is loaded at function entry and stored back before returns and "
+             "calls"));
+
+static cl::opt<bool> opaqueLoopInvariant(
+    "opaque-loop-invariant", cl::init(false),
+    cl::desc("Only use loop invariant operands and no stores for opaque "
+             "predicates in loops, so that they can be hoisted and the loops "
+             "still vectorized"));
+
+namespace {
+// Stubs created by createStub in a module and the functions holding copies
+// of stubs, until they are resolved
+struct ModuleStubs {
+  std::vector<WeakVH> stubs;
+  std::vector<WeakVH> functions;
+};
+};
+
+// Cleared when the pass is done with a module, so that a later module at the
+// same address starts afresh
+static DenseMap<Module *, ModuleStubs> stubRegistry;
+
+// Weight of the edge an opaque predicate always takes. The other edge has a
+// weight of 1
+static const uint32_t takenWeight = 1U << 20;
+
 bool OpaquePredicate::runOnModule(Module &M) {
   if (disableOpaquePred)
     return false;
 
-  // Seed engine and create distribution
-  if (!opaqueSeed.empty()) {
-    std::seed_seq seed(opaqueSeed.begin(), opaqueSeed.end());
-    engine.seed(seed);
-  } else {
-    unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-    engine.seed(seed);
-  }
-
   // Create globals
-  std::vector<GlobalVariable *> globals = prepareModule(M);
+  std::vector<Constant *> globals = prepareModule(M);
 
   std::uniform_int_distribution<int> distribution;
   std::uniform_int_distribution<int> distributionType(0, 1);
 
   LLVMContext &context = M.getContext();
   unsigned metaKind = context.getMDKindID(unreachableMarkName);
+  unsigned stubKind = context.getMDKindID(stubName);
 
-  for (auto &function : M) {
-    DEBUG(errs() << "\tFunction " << function.getName() << "\n");
+  // Group the stubs by function
+  DenseMap<Function *, std::vector<BranchInst *> > stubs;
+  auto scan = [&](Function &function) {
     for (auto &block : function) {
       TerminatorInst *terminator = block.getTerminator();
+      if (terminator &&
+          getInstructionType(*terminator, stubKind) != PredicateNone)
+        stubs[&function].push_back(cast<BranchInst>(terminator));
+    }
+  };
+  auto registered = stubRegistry.find(&M);
+  if (registered != stubRegistry.end()) {
+    // Functions with copied stubs are scanned in full, the others only have
+    // their registered stubs
+    SmallPtrSet<Function *, 8> scanned;
+    for (auto &handle : registered->second.functions) {
+      Value *value = handle;
+      if (Function *function = dyn_cast_or_null<Function>(value))
+        scanned.insert(function);
+    }
+    for (auto &handle : registered->second.stubs) {
+      // The stub may have been deleted since
+      Value *value = handle;
+      BranchInst *branch = dyn_cast_or_null<BranchInst>(value);
+      if (branch && branch->getParent() &&
+          !scanned.count(branch->getParent()->getParent()) &&
+          getInstructionType(*branch, stubKind) != PredicateNone)
+        stubs[branch->getParent()->getParent()].push_back(branch);
+    }
+    for (auto function : scanned)
+      scan(*function);
+    stubRegistry.erase(registered);
+  } else {
+    // The stubs were not created in this process, e.g. read from bitcode
+    for (auto &function : M)
+      scan(function);
+  }
 
-      PredicateType type = getInstructionType(*terminator, stubName);
-      if (type == PredicateNone) {
-        continue;
-      }
-
-      BranchInst *branch = dyn_cast<BranchInst>(terminator);
-      assert(branch && "Terminator should be a branch!");
+  for (auto &function : M) {
+    auto found = stubs.find(&function);
+    if (found == stubs.end())
+      continue;
+    DEBUG(errs() << "\tFunction " << function.getName() << "\n");
+    engine = ObfUtils::getEngine("opaque", opaqueSeed, function);
+    // Hot blocks only get cheap formulae
+    std::unique_ptr<ObfUtils::HotnessFilter> hotness;
+    if (ObfUtils::HotnessFilter::isEnabled() && !function.isDeclaration()) {
+      hotness.reset(new ObfUtils::HotnessFilter(
+          function, getAnalysis<BlockFrequencyInfo>(function)));
+    }
+    DominatorTree *DT = nullptr;
+    if ((opaqueSource == LiveSource || opaqueLoopInvariant) &&
+        !function.isDeclaration())
+      DT = &getAnalysis<DominatorTree>(function);
+    LoopInfo *LI = nullptr;
+    if (opaqueLoopInvariant && !function.isDeclaration())
+      LI = &getAnalysis<LoopInfo>(function);
+    // Never taken successors only reached through their predicate
+    std::vector<BasicBlock *> coldBlocks;
+    for (auto branch : found->second) {
+      BasicBlock &block = *branch->getParent();
+      PredicateType type = getInstructionType(*branch, stubKind);
       assert(branch->isConditional() &&
              "Stub terminator should be conditional!");
 
@@ -96,29 +222,60 @@ bool OpaquePredicate::runOnModule(Module &M) {
       branch->eraseFromParent();
       compare->eraseFromParent();
 
+      FormulaCost maxCost = opaqueMaxCost;
+      if (hotness && hotness->isHot(&block)) {
+        DEBUG(errs() << "\t\tHot block -- cheap formula\n");
+        maxCost = CheapFormula;
+      }
+
+      std::vector<Value *> live;
+      Loop *loop = LI ? LI->getLoopFor(&block) : nullptr;
+      if (loop) {
+        // Keep only the values defined outside of the loop
+        for (auto value : getLiveValues(&block, DT)) {
+          Instruction *inst = dyn_cast<Instruction>(value);
+          if (!inst || !loop->contains(inst->getParent()))
+            live.push_back(value);
+        }
+        DEBUG(errs() << "\t\tIn loop -- " << live.size()
+                     << " invariant values\n");
+      } else if (opaqueSource == LiveSource) {
+        live = getLiveValues(&block, DT);
+      }
+      // Stores of the globals would keep the loop from being vectorized
+      bool advance = !loop;
+
       PredicateType createdType;
       if (type == PredicateTrue) {
-        createTrue(&block, trueBlock, falseBlock, globals, [&]{
+        createTrue(&block, trueBlock, falseBlock, globals, live, [&]{
           return distribution(engine);
-        });
+        }, maxCost, advance);
         createdType = PredicateTrue;
       } else if (type == PredicateFalse) {
-        createFalse(&block, trueBlock, falseBlock, globals, [&]{
+        createFalse(&block, trueBlock, falseBlock, globals, live, [&]{
           return distribution(engine);
-        });
-        createdType = PredicateTrue;
+        }, maxCost, advance);
+        createdType = PredicateFalse;
       } else {
-        createdType = create(&block, trueBlock, falseBlock, globals, [&]{
+        createdType = create(&block, trueBlock, falseBlock, globals, live, [&]{
           return distribution(engine);
         },
                              [&]()->OpaquePredicate::PredicateType{
           return static_cast<OpaquePredicate::PredicateType>(
               distributionType(engine));
-        });
+        }, maxCost, advance);
         DEBUG(errs() << "\t\tOpaque Predicate Created: " << createdType
                      << "\n");
       }
 
+      if (ObfProfile::isGenerating())
+        ObfProfile::instrument(&block, ObfProfile::OpaqueSite);
+
+      BasicBlock *neverTaken =
+          createdType == PredicateTrue ? falseBlock : trueBlock;
+      if (opaqueBranchWeights && neverTaken->getSinglePredecessor() == &block)
+        coldBlocks.push_back(neverTaken);
+
       // Check if we want any marking
       if (mark) {
         switch (createdType) {
@@ -138,12 +295,20 @@ bool OpaquePredicate::runOnModule(Module &M) {
       }
       // DEBUG_WITH_TYPE("opaque_cfg", function.viewCFG());
     }
+
+    // Keep the real path as the fall through
+    for (auto cold : coldBlocks) {
+      cold->moveAfter(&function.back());
+    }
+
+    if (opaqueHoistState && !function.isDeclaration())
+      hoistState(function, globals);
   }
   return true;
 }
 
 // TODO: Use some runtime randomniser? Maybe?
-Value *OpaquePredicate::advanceGlobal(BasicBlock *block, GlobalVariable *global,
+Value *OpaquePredicate::advanceGlobal(BasicBlock *block, Constant *global,
                                       OpaquePredicate::Randomner randomner) {
   assert(global && "Null global pointer");
   DEBUG(errs() << "[Opaque Predicate] Randomly advancing global\n");
@@ -186,6 +351,89 @@ Value *OpaquePredicate::advanceGlobal(BasicBlock *block, GlobalVariable *global,
   return (Value *)returnValue;
 }
 
+void OpaquePredicate::hoistState(Function &F,
+                                 const std::vector<Constant *> &globals) {
+  SmallPtrSet<Value *, 8> state(globals.begin(), globals.end());
+  std::vector<LoadInst *> loads;
+  std::vector<StoreInst *> stores;
+  // Points where the globals have to hold the current state
+  std::vector<Instruction *> exits;
+  // Calls after which the state is reloaded
+  std::vector<CallInst *> calls;
+  for (auto &block : F) {
+    for (auto &inst : block) {
+      if (LoadInst *load = dyn_cast<LoadInst>(&inst)) {
+        if (state.count(load->getPointerOperand()))
+          loads.push_back(load);
+      } else if (StoreInst *store = dyn_cast<StoreInst>(&inst)) {
+        if (state.count(store->getPointerOperand()))
+          stores.push_back(store);
+      } else if (isa<ReturnInst>(&inst) || isa<ResumeInst>(&inst)) {
+        exits.push_back(&inst);
+      } else if (isa<IntrinsicInst>(&inst)) {
+        continue;
+      } else if (CallInst *call = dyn_cast<CallInst>(&inst)) {
+        // Callees that do not read memory cannot observe the state
+        if (!call->doesNotAccessMemory()) {
+          exits.push_back(call);
+          calls.push_back(call);
+        }
+      } else if (InvokeInst *invoke = dyn_cast<InvokeInst>(&inst)) {
+        if (!invoke->doesNotAccessMemory())
+          exits.push_back(invoke);
+      }
+    }
+  }
+  if (stores.empty())
+    return;
+
+  DEBUG(errs() << "\tHoisting state of " << F.getName() << "\n");
+  // Shadow every global advanced in the function with a stack slot
+  std::vector<Constant *> used;
+  for (auto global : globals) {
+    for (auto store : stores) {
+      if (store->getPointerOperand() == global) {
+        used.push_back(global);
+        break;
+      }
+    }
+  }
+  Instruction *entry = F.getEntryBlock().getFirstInsertionPt();
+  DenseMap<Value *, AllocaInst *> slots;
+  std::vector<AllocaInst *> allocas;
+  for (auto global : used) {
+    AllocaInst *slot =
+        new AllocaInst(Type::getInt32Ty(F.getContext()), "", entry);
+    new StoreInst(new LoadInst(global, "", entry), slot, entry);
+    slots[global] = slot;
+    allocas.push_back(slot);
+  }
+
+  for (auto load : loads) {
+    load->setOperand(0, slots[load->getPointerOperand()]);
+  }
+  for (auto store : stores) {
+    store->setOperand(1, slots[store->getPointerOperand()]);
+  }
+
+  for (auto exit : exits) {
+    for (auto global : used) {
+      new StoreInst(new LoadInst(slots[global], "", exit), global, exit);
+    }
+  }
+  // The callee may have advanced the state in the meantime. Invokes do not
+  // reload: stale state is still valid input to every formula
+  for (auto call : calls) {
+    BasicBlock::iterator next = call;
+    ++next;
+    for (auto global : used) {
+      new StoreInst(new LoadInst(global, "", next), slots[global], next);
+    }
+  }
+
+  ObfUtils::promoteAllocas(allocas, getAnalysis<DominatorTree>(F));
+}
+
 // 7y^2 -1 != x^2 for all x, y in Z
 Value *OpaquePredicate::formula0(BasicBlock *block, Value *x, Value *y,
                                  OpaquePredicate::PredicateType type) {
@@ -324,30 +572,169 @@ Value *OpaquePredicate::formula2(BasicBlock *block, Value *x, Value *y1,
     return BinaryOperator::CreateNot(condition, "", block);
 }
 
+// 7y^2 - 1 != x^2 for all x, y in Z/2^32Z
+// Squares are 0, 1 or 4 mod 8 while 7y^2 - 1 is 3, 6 or 7 mod 8
+Value *OpaquePredicate::formula3(BasicBlock *block, Value *x, Value *y,
+                                 OpaquePredicate::PredicateType type) {
+  assert(type != OpaquePredicate::PredicateIndeterminate &&
+         "Formula 3 does not support indeterminate!");
+
+  Type *intType = x->getType();
+  Value *seven = ConstantInt::get(intType, 7, false);
+  Value *one = ConstantInt::get(intType, 1, false);
+  // x^2
+  Value *x2 =
+      (Value *)BinaryOperator::Create(Instruction::Mul, x, x, "", block);
+  // y^2
+  Value *y2 =
+      (Value *)BinaryOperator::Create(Instruction::Mul, y, y, "", block);
+  // 7y^2
+  Value *y3 =
+      (Value *)BinaryOperator::Create(Instruction::Mul, y2, seven, "", block);
+  // 7y^2 - 1
+  Value *y4 =
+      (Value *)BinaryOperator::Create(Instruction::Sub, y3, one, "", block);
+
+  if (type == OpaquePredicate::PredicateTrue)
+    return CmpInst::Create(Instruction::ICmp, ICmpInst::ICMP_NE, x2, y4, "",
+                           block);
+  else
+    return CmpInst::Create(Instruction::ICmp, ICmpInst::ICMP_EQ, x2, y4, "",
+                           block);
+}
+
+// x(x + 1) % 2 == 0 for all x in Z/2^32Z
+Value *OpaquePredicate::formula4(BasicBlock *block, Value *x, Value *y1,
+                                 OpaquePredicate::PredicateType type) {
+  // y1 is unused
+  assert(type != OpaquePredicate::PredicateIndeterminate &&
+         "Formula 4 does not support indeterminate!");
+
+  Type *intType = x->getType();
+  Value *zero = ConstantInt::get(intType, 0, false);
+  Value *one = ConstantInt::get(intType, 1, false);
+  // x + 1
+  Value *x1 =
+      (Value *)BinaryOperator::Create(Instruction::Add, x, one, "", block);
+  // x(x + 1)
+  Value *x2 =
+      (Value *)BinaryOperator::Create(Instruction::Mul, x, x1, "", block);
+  // x(x + 1) % 2
+  Value *mod =
+      (Value *)BinaryOperator::Create(Instruction::And, x2, one, "", block);
+
+  if (type == OpaquePredicate::PredicateTrue)
+    return CmpInst::Create(Instruction::ICmp, ICmpInst::ICMP_EQ, mod, zero, "",
+                           block);
+  else
+    return CmpInst::Create(Instruction::ICmp, ICmpInst::ICMP_NE, mod, zero, "",
+                           block);
+}
+
+// (x ^ y) + 2(x & y) == x + y for all x, y in Z/2^32Z
+Value *OpaquePredicate::formula5(BasicBlock *block, Value *x, Value *y,
+                                 OpaquePredicate::PredicateType type) {
+  assert(type != OpaquePredicate::PredicateIndeterminate &&
+         "Formula 5 does not support indeterminate!");
+
+  Type *intType = x->getType();
+  Value *one = ConstantInt::get(intType, 1, false);
+  // x ^ y
+  Value *xor1 =
+      (Value *)BinaryOperator::Create(Instruction::Xor, x, y, "", block);
+  // 2(x & y)
+  Value *and1 =
+      (Value *)BinaryOperator::Create(Instruction::And, x, y, "", block);
+  Value *and2 =
+      (Value *)BinaryOperator::Create(Instruction::Shl, and1, one, "", block);
+  // (x ^ y) + 2(x & y)
+  Value *lhs =
+      (Value *)BinaryOperator::Create(Instruction::Add, xor1, and2, "", block);
+  // x + y
+  Value *rhs =
+      (Value *)BinaryOperator::Create(Instruction::Add, x, y, "", block);
+
+  if (type == OpaquePredicate::PredicateTrue)
+    return CmpInst::Create(Instruction::ICmp, ICmpInst::ICMP_EQ, lhs, rhs, "",
+                           block);
+  else
+    return CmpInst::Create(Instruction::ICmp, ICmpInst::ICMP_NE, lhs, rhs, "",
+                           block);
+}
+
 OpaquePredicate::Formula
-OpaquePredicate::getFormula(OpaquePredicate::Randomner randomner) {
-  static const int number = 3;
-  static Formula formales[number] = { formula0, formula1, formula2 };
-  int n = randomner() % number;
+OpaquePredicate::getFormula(OpaquePredicate::Randomner randomner,
+                            OpaquePredicate::FormulaCost maxCost) {
+  struct FormulaInfo {
+    Formula formula;
+    FormulaCost cost;
+  };
+  static const int number = 6;
+  static FormulaInfo formales[number] = {
+    { formula0, ExpensiveFormula }, { formula1, ExpensiveFormula },
+    { formula2, MediumFormula },    { formula3, CheapFormula },
+    { formula4, CheapFormula },     { formula5, CheapFormula }
+  };
+
+  if (opaqueFormula >= number) {
+    LLVMContext &ctx = getGlobalContext();
+    ctx.emitError("OpaquePredicate: opaque-formula out of range");
+  } else if (opaqueFormula >= 0) {
+    return formales[opaqueFormula].formula;
+  }
+
+  int candidates[number], count = 0;
+  for (int i = 0; i < number; ++i) {
+    if (formales[i].cost <= maxCost)
+      candidates[count++] = i;
+  }
+  int n = candidates[randomner() % count];
   DEBUG(errs() << "[Opaque Predicate] Formula " << n << "\n");
-  return formales[n];
+  return formales[n].formula;
 }
 
-std::vector<GlobalVariable *> OpaquePredicate::prepareModule(Module &M) {
+std::vector<Constant *> OpaquePredicate::prepareModule(Module &M) {
   assert(opaqueGlobal >= 2 &&
          "Opaque Predicates need at least 2 global variables");
   DEBUG(errs() << "[Opaque Predicate] Creating " << opaqueGlobal
                << " globals\n");
-  std::vector<GlobalVariable *> globals(opaqueGlobal);
+  std::vector<Constant *> globals(opaqueGlobal);
+  LLVMContext &context = M.getContext();
+  Type *intType = Type::getInt32Ty(context);
+  // Fills the rest of the cache line of a padded global, so that nothing
+  // else can be placed next to it
+  Type *paddedType = StructType::get(
+      intType, ArrayType::get(Type::getInt8Ty(context), cacheLineSize - 4),
+      NULL);
   for (unsigned i = 0; i < opaqueGlobal; ++i) {
     Twine globalName("");
     DEBUG(globalName = globalName.concat(Twine("global_")).concat(Twine(i)));
-    Value *zero = ConstantInt::get(Type::getInt32Ty(M.getContext()), 0, true);
-    GlobalVariable *global = new GlobalVariable(
-        M, Type::getInt32Ty(M.getContext()), false, GlobalValue::CommonLinkage,
-        (Constant *)zero, globalName);
+    Value *zero = ConstantInt::get(intType, 0, true);
+    GlobalVariable *global;
+    if (opaqueState == ThreadLocalState) {
+      // Common symbols cannot be thread local
+      global = new GlobalVariable(M, intType, false,
+                                  GlobalValue::InternalLinkage,
+                                  (Constant *)zero, globalName, nullptr,
+                                  GlobalVariable::GeneralDynamicTLSModel);
+    } else if (opaqueState == PaddedState) {
+      global = new GlobalVariable(M, paddedType, false,
+                                  GlobalValue::CommonLinkage,
+                                  Constant::getNullValue(paddedType),
+                                  globalName);
+      global->setAlignment(cacheLineSize);
+    } else {
+      global = new GlobalVariable(M, intType, false,
+                                  GlobalValue::CommonLinkage, (Constant *)zero,
+                                  globalName);
+    }
     assert(global && "Null globals created!");
     globals[i] = global;
+    if (opaqueState == PaddedState) {
+      Constant *indices[] = { ConstantInt::get(intType, 0),
+                              ConstantInt::get(intType, 0) };
+      globals[i] = ConstantExpr::getInBoundsGetElementPtr(global, indices);
+    }
   }
   return globals;
 }
@@ -355,16 +742,20 @@ std::vector<GlobalVariable *> OpaquePredicate::prepareModule(Module &M) {
 OpaquePredicate::PredicateType
 OpaquePredicate::create(BasicBlock *headBlock, BasicBlock *trueBlock,
                         BasicBlock *falseBlock,
-                        const std::vector<GlobalVariable *> &globals,
-                        Randomner randomner, PredicateTypeRandomner typeRand) {
+                        const std::vector<Constant *> &globals,
+                        const std::vector<Value *> &live, Randomner randomner,
+                        PredicateTypeRandomner typeRand, FormulaCost maxCost,
+                        bool advance) {
 
   PredicateType type = typeRand();
   switch (type) {
   case PredicateFalse:
-    createFalse(headBlock, trueBlock, falseBlock, globals, randomner);
+    createFalse(headBlock, trueBlock, falseBlock, globals, live, randomner,
+                maxCost, advance);
     break;
   case PredicateTrue:
-    createTrue(headBlock, trueBlock, falseBlock, globals, randomner);
+    createTrue(headBlock, trueBlock, falseBlock, globals, live, randomner,
+               maxCost, advance);
   case PredicateIndeterminate:
     break;
   default:
@@ -375,48 +766,157 @@ OpaquePredicate::create(BasicBlock *headBlock, BasicBlock *trueBlock,
 
 void OpaquePredicate::createTrue(BasicBlock *headBlock, BasicBlock *trueBlock,
                                  BasicBlock *falseBlock,
-                                 const std::vector<GlobalVariable *> &globals,
-                                 OpaquePredicate::Randomner randomner) {
-  // Get our x and y
-  GlobalVariable *x = globals[randomner() % globals.size()];
-  GlobalVariable *y = globals[randomner() % globals.size()];
-
-  while (x == y) {
-    y = globals[randomner() % globals.size()];
-  }
-
-  // Advance our x and y
-  Value *x1 = advanceGlobal(headBlock, x, randomner);
-  Value *y1 = advanceGlobal(headBlock, y, randomner);
-
-  Formula formula = getFormula(randomner);
+                                 const std::vector<Constant *> &globals,
+                                 const std::vector<Value *> &live,
+                                 OpaquePredicate::Randomner randomner,
+                                 OpaquePredicate::FormulaCost maxCost,
+                                 bool advance) {
+  Value *x1, *y1;
+  getOperands(headBlock, globals, live, randomner, advance, x1, y1);
+
+  Formula formula = getFormula(randomner, maxCost);
   Value *condition = formula(headBlock, x1, y1, PredicateTrue);
 
   // Branch
-  BranchInst::Create(trueBlock, falseBlock, condition, headBlock);
+  BranchInst *branch =
+      BranchInst::Create(trueBlock, falseBlock, condition, headBlock);
+  setBranchWeights(branch, PredicateTrue);
 }
 
 void OpaquePredicate::createFalse(BasicBlock *headBlock, BasicBlock *trueBlock,
                                   BasicBlock *falseBlock,
-                                  const std::vector<GlobalVariable *> &globals,
-                                  OpaquePredicate::Randomner randomner) {
+                                  const std::vector<Constant *> &globals,
+                                  const std::vector<Value *> &live,
+                                  OpaquePredicate::Randomner randomner,
+                                  OpaquePredicate::FormulaCost maxCost,
+                                  bool advance) {
+  Value *x1, *y1;
+  getOperands(headBlock, globals, live, randomner, advance, x1, y1);
+
+  Formula formula = getFormula(randomner, maxCost);
+  Value *condition = formula(headBlock, x1, y1, PredicateFalse);
+
+  // Branch
+  BranchInst *branch =
+      BranchInst::Create(trueBlock, falseBlock, condition, headBlock);
+  setBranchWeights(branch, PredicateFalse);
+}
+
+void OpaquePredicate::getOperands(BasicBlock *block,
+                                  const std::vector<Constant *> &globals,
+                                  const std::vector<Value *> &live,
+                                  OpaquePredicate::Randomner randomner,
+                                  bool advance, Value *&x, Value *&y) {
+  if (live.size() >= 2) {
+    // Every formula holds for any pair of i32 values
+    Type *intType = Type::getInt32Ty(block->getContext());
+    unsigned i = randomner() % live.size();
+    unsigned j = randomner() % live.size();
+    while (i == j) {
+      j = randomner() % live.size();
+    }
+    x = CastInst::CreateIntegerCast(live[i], intType, true, "", block);
+    y = CastInst::CreateIntegerCast(live[j], intType, true, "", block);
+    return;
+  }
+
   // Get our x and y
-  GlobalVariable *x = globals[abs(randomner()) % globals.size()];
-  GlobalVariable *y = globals[abs(randomner()) % globals.size()];
+  Constant *xGlobal = globals[abs(randomner()) % globals.size()];
+  Constant *yGlobal = globals[abs(randomner()) % globals.size()];
 
-  while (x == y) {
-    y = globals[randomner() % globals.size()];
+  while (xGlobal == yGlobal) {
+    yGlobal = globals[abs(randomner()) % globals.size()];
+  }
+
+  if (!advance) {
+    x = new LoadInst(xGlobal, "", block);
+    y = new LoadInst(yGlobal, "", block);
+    return;
   }
 
   // Advance our x and y
-  Value *x1 = advanceGlobal(headBlock, x, randomner);
-  Value *y1 = advanceGlobal(headBlock, y, randomner);
+  x = advanceGlobal(block, xGlobal, randomner);
+  y = advanceGlobal(block, yGlobal, randomner);
+}
 
-  Formula formula = getFormula(randomner);
-  Value *condition = formula(headBlock, x1, y1, PredicateFalse);
+std::vector<Value *> OpaquePredicate::getLiveValues(BasicBlock *block,
+                                                    DominatorTree *DT) {
+  std::vector<Value *> live;
+  Function *F = block->getParent();
+  for (auto &arg : F->getArgumentList()) {
+    if (arg.getType()->isIntegerTy())
+      live.push_back(&arg);
+  }
 
-  // Branch
-  BranchInst::Create(trueBlock, falseBlock, condition, headBlock);
+  // Unreachable blocks have no dominator tree node
+  DomTreeNode *node = DT->getNode(block);
+  BasicBlock *dominator = block;
+  while (dominator) {
+    for (auto &inst : *dominator) {
+      if (!inst.getType()->isIntegerTy() || inst.getType()->isIntegerTy(1))
+        continue;
+      // Only defined on the normal path
+      if (isa<InvokeInst>(&inst))
+        continue;
+      // Every use of a value derived from undef may read something different
+      SmallPtrSet<Value *, 16> visited;
+      if (!isDefined(&inst, visited, 6))
+        continue;
+      live.push_back(&inst);
+    }
+    if (!node)
+      break;
+    node = node->getIDom();
+    dominator = node ? node->getBlock() : nullptr;
+  }
+  DEBUG(errs() << "\t\t" << live.size() << " live values\n");
+  return live;
+}
+
+bool OpaquePredicate::isDefined(Value *value,
+                                SmallPtrSet<Value *, 16> &visited,
+                                unsigned depth) {
+  if (isa<UndefValue>(value))
+    return false;
+  if (isa<Argument>(value) || isa<Constant>(value))
+    return true;
+  // Cycles through PHI nodes bring no undef of their own
+  if (!visited.insert(value))
+    return true;
+  Instruction *inst = dyn_cast<Instruction>(value);
+  if (!inst || isa<CallInst>(inst) || isa<InvokeInst>(inst))
+    return true;
+  if (LoadInst *load = dyn_cast<LoadInst>(inst))
+    return !isa<AllocaInst>(GetUnderlyingObject(load->getPointerOperand()));
+  if (!depth)
+    return false;
+  for (auto &operand : inst->operands()) {
+    if (!isDefined(operand, visited, depth - 1))
+      return false;
+  }
+  return true;
+}
+
+void OpaquePredicate::getAnalysisUsage(AnalysisUsage &AU) const {
+  // Stubs are replaced by branches to the same successors
+  AU.setPreservesCFG();
+  if (ObfUtils::HotnessFilter::isEnabled())
+    AU.addRequired<BlockFrequencyInfo>();
+  if (opaqueHoistState || opaqueSource == LiveSource || opaqueLoopInvariant)
+    AU.addRequired<DominatorTree>();
+  if (opaqueLoopInvariant)
+    AU.addRequired<LoopInfo>();
+}
+
+void OpaquePredicate::setBranchWeights(BranchInst *branch,
+                                       OpaquePredicate::PredicateType type) {
+  if (!opaqueBranchWeights)
+    return;
+  MDBuilder builder(branch->getContext());
+  MDNode *weights = type == PredicateTrue
+                        ? builder.createBranchWeights(takenWeight, 1)
+                        : builder.createBranchWeights(1, takenWeight);
+  branch->setMetadata(LLVMContext::MD_prof, weights);
 }
 
 void OpaquePredicate::createStub(BasicBlock *block, BasicBlock *trueBlock,
@@ -436,6 +936,7 @@ void OpaquePredicate::createStub(BasicBlock *block, BasicBlock *trueBlock,
   BranchInst *branch =
       BranchInst::Create(trueBlock, falseBlock, (Value *)condition, block);
   tagInstruction(*branch, stubName, type);
+  stubRegistry[block->getParent()->getParent()].stubs.push_back(branch);
 
   if (!markUnreachable) {
     LLVMContext &context = block->getContext();
@@ -446,6 +947,15 @@ void OpaquePredicate::createStub(BasicBlock *block, BasicBlock *trueBlock,
   }
 }
 
+void OpaquePredicate::registerStubs(Function &F) {
+  stubRegistry[F.getParent()].functions.push_back(&F);
+}
+
+bool OpaquePredicate::doFinalization(Module &M) {
+  stubRegistry.erase(&M);
+  return false;
+}
+
 void OpaquePredicate::tagInstruction(Instruction &inst, StringRef metaKindName,
                                      OpaquePredicate::PredicateType type) {
   LLVMContext &context = inst.getContext();
@@ -458,8 +968,11 @@ void OpaquePredicate::tagInstruction(Instruction &inst, StringRef metaKindName,
 OpaquePredicate::PredicateType
 OpaquePredicate::getInstructionType(Instruction &inst, StringRef metaKindName) {
   LLVMContext &context = inst.getContext();
-  unsigned metaKind = context.getMDKindID(metaKindName);
+  return getInstructionType(inst, context.getMDKindID(metaKindName));
+}
 
+OpaquePredicate::PredicateType
+OpaquePredicate::getInstructionType(Instruction &inst, unsigned metaKind) {
   MDNode *meta = inst.getMetadata(metaKind);
 
   if (!meta) {
@@ -0,0 +1,419 @@
+//=== policy.cpp - Per function obfuscation policy ------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+// Rules with an exact name are kept in a hash table, globs are turned into
+// anchored regular expressions. The decision for a function is made once per
+// module and cached by name.
+#define DEBUG_TYPE "policy"
+#include "Transform/policy.h"
+#include "llvm/ADT/OwningPtr.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Regex.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/YAMLParser.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/system_error.h"
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <utility>
+#include <vector>
+
+static cl::opt<std::string>
+    policyFile("obf-policy", cl::init(""),
+               cl::desc("YAML or JSON file choosing the transformations and "
+                        "intensity of each function"));
+
+STATISTIC(NumGoverned, "Number of functions governed by the policy");
+STATISTIC(NumAnnotations, "Number of obf annotations read");
+
+namespace {
+const char *annotationPrefix = "obf:";
+
+// What a rule or an annotation sets. Fields that are not set are inherited
+// from the default of the policy file, or left to the pass options
+struct Rule {
+  bool hasTransforms;
+  bool hasIntensity;
+  unsigned transforms;
+  double intensity;
+
+  Rule()
+      : hasTransforms(false), hasIntensity(false),
+        transforms(ObfPolicy::AllTransforms), intensity(1.0) {}
+
+  bool isSet() const { return hasTransforms || hasIntensity; }
+
+  // The fields set in other take precedence
+  void merge(const Rule &other) {
+    if (other.hasTransforms) {
+      hasTransforms = true;
+      transforms = other.transforms;
+    }
+    if (other.hasIntensity) {
+      hasIntensity = true;
+      intensity = other.intensity;
+    }
+  }
+};
+
+// Returns 0 for none and unknown names
+unsigned parseTransform(StringRef name) {
+  return StringSwitch<unsigned>(name)
+      .Case("copy", ObfPolicy::CopyTransform)
+      .Case("flatten", ObfPolicy::FlattenTransform)
+      .Case("boguscf", ObfPolicy::BogusCFTransform)
+      .Case("loop-boguscf", ObfPolicy::LoopBogusCFTransform)
+      .Case("inline", ObfPolicy::InlineTransform)
+      .Case("all", ObfPolicy::AllTransforms)
+      .Default(0);
+}
+
+// Returns false if text is neither a level nor a number between 0 and 1
+bool parseIntensity(StringRef text, double &intensity) {
+  intensity = StringSwitch<double>(text)
+                  .Case("none", 0.0)
+                  .Case("light", 0.25)
+                  .Case("medium", 0.5)
+                  .Case("heavy", 1.0)
+                  .Default(-1.0);
+  if (intensity >= 0.0)
+    return true;
+  // Like cl::parser<double>, which needs a terminated string
+  std::string copy = text.str();
+  const char *start = copy.c_str();
+  char *end;
+  intensity = strtod(start, &end);
+  return end != start && *end == 0 && intensity >= 0.0 && intensity <= 1.0;
+}
+
+// Only * and ? are special
+std::string globToRegex(StringRef glob) {
+  std::string regex = "^";
+  for (char c : glob) {
+    if (c == '*') {
+      regex += ".*";
+    } else if (c == '?') {
+      regex += '.';
+    } else {
+      if (strchr("\\^$.|+()[]{}", c))
+        regex += '\\';
+      regex += c;
+    }
+  }
+  return regex + "$";
+}
+
+// Rules read from -obf-policy and the annotations of the current module.
+// Loaded once and shared by every pass
+struct Policy {
+  Rule defaultRule;
+  StringMap<Rule> names;
+  std::vector<std::pair<std::unique_ptr<Regex>, Rule> > patterns;
+
+  // Annotations and decisions for the functions of annotatedModule
+  const Module *annotatedModule;
+  StringMap<Rule> annotations;
+  StringMap<Rule> decisions;
+
+  Policy() : annotatedModule(nullptr) {
+    if (!policyFile.empty())
+      load();
+  }
+
+  const Rule &decide(const Function &F) {
+    const Module *M = F.getParent();
+    if (M != annotatedModule) {
+      readAnnotations(*M);
+      decisions.clear();
+      annotatedModule = M;
+    }
+
+    StringRef name = F.getName();
+    auto cached = decisions.find(name);
+    if (cached != decisions.end())
+      return cached->second;
+
+    Rule rule = defaultRule;
+    auto named = names.find(name);
+    if (named != names.end()) {
+      rule.merge(named->second);
+    } else {
+      for (auto &pattern : patterns) {
+        if (pattern.first->match(name)) {
+          rule.merge(pattern.second);
+          break;
+        }
+      }
+    }
+    auto annotation = annotations.find(name);
+    if (annotation != annotations.end())
+      rule.merge(annotation->second);
+
+    if (rule.isSet()) {
+      DEBUG(errs() << "Policy: " << name << " -- transforms " << rule.transforms
+                   << ", intensity " << rule.intensity << "\n");
+      ++NumGoverned;
+    }
+    return decisions[name] = rule;
+  }
+
+  void load() {
+    OwningPtr<MemoryBuffer> buffer;
+    if (MemoryBuffer::getFile(policyFile, buffer)) {
+      LLVMContext &ctx = getGlobalContext();
+      ctx.emitError("Policy: Unable to read " + policyFile);
+      return;
+    }
+
+    SourceMgr sourceMgr;
+    yaml::Stream stream(buffer->getBuffer(), sourceMgr);
+    bool valid = true;
+    for (auto document = stream.begin(), end = stream.end(); document != end;
+         ++document) {
+      yaml::Node *root = document->getRoot();
+      yaml::MappingNode *map = dyn_cast_or_null<yaml::MappingNode>(root);
+      if (!map) {
+        if (root)
+          stream.printError(root, "Expected a mapping");
+        valid = false;
+        continue;
+      }
+      for (auto &entry : *map) {
+        SmallString<16> storage;
+        StringRef key = getScalar(stream, entry.getKey(), storage);
+        if (key == "default") {
+          valid &= parseEntry(stream, entry.getValue(), true);
+        } else if (key == "functions") {
+          yaml::SequenceNode *functions =
+              dyn_cast<yaml::SequenceNode>(entry.getValue());
+          if (!functions) {
+            stream.printError(entry.getValue(), "Expected a sequence");
+            valid = false;
+            continue;
+          }
+          for (auto &function : *functions)
+            valid &= parseEntry(stream, &function, false);
+        } else {
+          stream.printError(entry.getKey(), Twine("Unknown key ") + key);
+          valid = false;
+        }
+      }
+    }
+
+    if (stream.failed() || !valid) {
+      LLVMContext &ctx = getGlobalContext();
+      ctx.emitError("Policy: Malformed policy " + policyFile);
+      return;
+    }
+    DEBUG(errs() << "Policy: " << names.size() << " names and "
+                 << patterns.size() << " patterns read\n");
+  }
+
+  static StringRef getScalar(yaml::Stream &stream, yaml::Node *node,
+                             SmallVectorImpl<char> &storage) {
+    yaml::ScalarNode *scalar = dyn_cast_or_null<yaml::ScalarNode>(node);
+    if (!scalar) {
+      if (node)
+        stream.printError(node, "Expected a scalar");
+      return StringRef();
+    }
+    return scalar->getValue(storage);
+  }
+
+  // Read the default or an entry of functions. Entries select functions with
+  // exactly one of name, glob and regex
+  bool parseEntry(yaml::Stream &stream, yaml::Node *node, bool isDefault) {
+    yaml::MappingNode *map = dyn_cast_or_null<yaml::MappingNode>(node);
+    if (!map) {
+      if (node)
+        stream.printError(node, "Expected a mapping");
+      return false;
+    }
+
+    Rule rule;
+    std::string name, regex;
+    unsigned selectors = 0;
+    bool valid = true;
+    for (auto &entry : *map) {
+      SmallString<16> keyStorage, storage;
+      StringRef key = getScalar(stream, entry.getKey(), keyStorage);
+      yaml::Node *value = entry.getValue();
+      if (key == "transforms") {
+        valid &= parseTransforms(stream, value, rule);
+      } else if (key == "intensity") {
+        StringRef text = getScalar(stream, value, storage);
+        if (!parseIntensity(text, rule.intensity)) {
+          stream.printError(value, Twine("Invalid intensity ") + text);
+          valid = false;
+        }
+        rule.hasIntensity = true;
+      } else if (!isDefault && key == "name") {
+        name = getScalar(stream, value, storage);
+        ++selectors;
+      } else if (!isDefault && key == "glob") {
+        regex = globToRegex(getScalar(stream, value, storage));
+        ++selectors;
+      } else if (!isDefault && key == "regex") {
+        regex = getScalar(stream, value, storage);
+        ++selectors;
+      } else {
+        stream.printError(entry.getKey(), Twine("Unknown key ") + key);
+        valid = false;
+      }
+    }
+    if (!valid)
+      return false;
+
+    if (isDefault) {
+      defaultRule = rule;
+      return true;
+    }
+    if (selectors != 1) {
+      stream.printError(node, "Expected one of name, glob or regex");
+      return false;
+    }
+    if (!regex.empty()) {
+      std::unique_ptr<Regex> pattern(new Regex(regex));
+      std::string error;
+      if (!pattern->isValid(error)) {
+        stream.printError(node, "Invalid pattern " + regex + ": " + error);
+        return false;
+      }
+      patterns.push_back(std::make_pair(std::move(pattern), rule));
+    } else if (!names.count(name)) {
+      // The first rule for a name wins, as for patterns
+      names[name] = rule;
+    }
+    return true;
+  }
+
+  // A transformation or a sequence of them
+  static bool parseTransforms(yaml::Stream &stream, yaml::Node *node,
+                              Rule &rule) {
+    rule.hasTransforms = true;
+    rule.transforms = 0;
+    bool valid = true;
+    auto add = [&](yaml::Node *item) {
+      SmallString<16> storage;
+      StringRef name = getScalar(stream, item, storage);
+      unsigned transform = parseTransform(name);
+      if (!transform && name != "none") {
+        stream.printError(item, Twine("Unknown transformation ") + name);
+        valid = false;
+      }
+      rule.transforms |= transform;
+    };
+    if (yaml::SequenceNode *sequence = dyn_cast<yaml::SequenceNode>(node)) {
+      for (auto &item : *sequence)
+        add(&item);
+    } else {
+      add(node);
+    }
+    return valid;
+  }
+
+  // Collect the obf: annotations in llvm.global.annotations. Each entry holds
+  // the annotated function and its string, behind casts
+  void readAnnotations(const Module &M) {
+    annotations.clear();
+    const GlobalVariable *global =
+        M.getNamedGlobal("llvm.global.annotations");
+    if (!global || !global->hasInitializer())
+      return;
+    const ConstantArray *entries =
+        dyn_cast<ConstantArray>(global->getInitializer());
+    if (!entries)
+      return;
+
+    for (unsigned i = 0, e = entries->getNumOperands(); i != e; ++i) {
+      const ConstantStruct *entry =
+          dyn_cast<ConstantStruct>(entries->getOperand(i));
+      if (!entry || entry->getNumOperands() < 2)
+        continue;
+      const Function *F =
+          dyn_cast<Function>(entry->getOperand(0)->stripPointerCasts());
+      const GlobalVariable *string =
+          dyn_cast<GlobalVariable>(entry->getOperand(1)->stripPointerCasts());
+      if (!F || !string || !string->hasInitializer())
+        continue;
+      const ConstantDataSequential *data =
+          dyn_cast<ConstantDataSequential>(string->getInitializer());
+      if (!data || !data->isCString())
+        continue;
+      StringRef text = data->getAsCString();
+      if (!text.startswith(annotationPrefix))
+        continue;
+
+      DEBUG(errs() << "Policy: " << F->getName() << " annotated " << text
+                   << "\n");
+      parseAnnotation(*F, text.substr(strlen(annotationPrefix)),
+                      annotations[F->getName()]);
+      ++NumAnnotations;
+    }
+  }
+
+  // Comma separated transformations and intensity. Several annotations of a
+  // function add up
+  static void parseAnnotation(const Function &F, StringRef text, Rule &rule) {
+    SmallVector<StringRef, 4> items;
+    text.split(items, ",");
+    for (StringRef item : items) {
+      item = item.trim();
+      double intensity;
+      if (unsigned transform = parseTransform(item)) {
+        if (!rule.hasTransforms)
+          rule.transforms = 0;
+        rule.hasTransforms = true;
+        rule.transforms |= transform;
+      } else if (item == "none") {
+        rule.hasTransforms = true;
+        rule.transforms = 0;
+      } else if (parseIntensity(item, intensity)) {
+        rule.hasIntensity = true;
+        rule.intensity = intensity;
+      } else {
+        LLVMContext &ctx = getGlobalContext();
+        ctx.emitError(Twine("Policy: Unknown item '") + item +
+                      "' in annotation of " + F.getName());
+      }
+    }
+  }
+};
+
+Policy &getPolicy() {
+  static Policy policy;
+  return policy;
+}
+};
+
+namespace ObfPolicy {
+bool governs(Function &F) { return getPolicy().decide(F).isSet(); }
+
+bool isAllowed(Function &F, Transform transform) {
+  const Rule &rule = getPolicy().decide(F);
+  return !rule.hasTransforms || (rule.transforms & transform);
+}
+
+double getProbability(Function &F, double fallback) {
+  const Rule &rule = getPolicy().decide(F);
+  return rule.hasIntensity ? rule.intensity : fallback;
+}
+};
@@ -0,0 +1,376 @@
+//=== profile.cpp - Obfuscation overhead profiling ------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+// Profile format: a sequence of records, one per module, each made of
+//  - u64 magic
+//  - u64 number of counters N
+//  - N u64 keys
+//  - N u64 counts
+// A key is the FNV-1a hash of the function name with the SiteKind in the low
+// 3 bits. Counts for the same key are summed.
+#define DEBUG_TYPE "profile"
+#include "Transform/profile.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/OwningPtr.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/system_error.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+using namespace llvm;
+
+static cl::opt<bool> profileGenerate(
+    "obf-profile-generate", cl::init(false),
+    cl::desc("Instrument the obfuscated code to collect an overhead profile"));
+
+static cl::opt<std::string> profileFile(
+    "obf-profile-file", cl::init("obf.profdata"),
+    cl::desc("File the instrumented program appends its profile to"));
+
+static cl::opt<std::string>
+    profileUse("obf-profile-use", cl::init(""),
+               cl::desc("Profile used to keep obfuscation within budget"));
+
+static cl::opt<std::string> overheadBudget(
+    "obf-overhead-budget", cl::init(""),
+    cl::desc("Maximum estimated runtime overhead, e.g. 5% or 0.05"));
+
+STATISTIC(NumSites, "Number of profile counters inserted");
+STATISTIC(NumDisabled, "Number of transformations disabled by the budget");
+
+namespace {
+const uint64_t profileMagic = 0x31464f5250464f42ULL; // "BOFPROF1"
+const char *sitesName = "obf.profile.sites";
+
+// Estimated cost of one execution of each site, in instructions
+const uint64_t flattenCost = 8;
+const uint64_t predicateCost = 20;
+
+uint64_t getKey(StringRef functionName, ObfProfile::SiteKind kind) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (char c : functionName) {
+    hash ^= (unsigned char)c;
+    hash *= 0x100000001b3ULL;
+  }
+  return (hash & ~7ULL) | kind;
+}
+
+// Profile read back with -obf-profile-use and the transformations it rules
+// out. Loaded once and shared by every pass
+struct Plan {
+  DenseMap<uint64_t, uint64_t> counts;
+  DenseSet<uint64_t> disabled;
+
+  Plan() { load(); }
+
+  uint64_t count(uint64_t function, ObfProfile::SiteKind kind) const {
+    auto found = counts.find(function | kind);
+    return found == counts.end() ? 0 : found->second;
+  }
+
+  void load() {
+    OwningPtr<MemoryBuffer> buffer;
+    if (MemoryBuffer::getFile(profileUse, buffer)) {
+      LLVMContext &ctx = getGlobalContext();
+      ctx.emitError("Profile: Unable to read " + profileUse);
+      return;
+    }
+
+    const char *data = buffer->getBufferStart();
+    size_t size = buffer->getBufferSize(), offset = 0;
+    auto read = [&]() {
+      uint64_t value;
+      memcpy(&value, data + offset, sizeof(value));
+      offset += sizeof(value);
+      return value;
+    };
+    while (offset + 16 <= size) {
+      uint64_t magic = read(), n = read();
+      // Written so that a huge n cannot wrap around
+      if (magic != profileMagic || n > (size - offset) / 16) {
+        LLVMContext &ctx = getGlobalContext();
+        ctx.emitError("Profile: Malformed profile " + profileUse);
+        return;
+      }
+      size_t keys = offset;
+      offset += n * 8;
+      for (uint64_t i = 0; i < n; ++i) {
+        uint64_t key;
+        memcpy(&key, data + keys + i * 8, sizeof(key));
+        counts[key] += read();
+      }
+    }
+    DEBUG(errs() << "Profile: " << counts.size() << " counters read\n");
+
+    plan(parseBudget());
+  }
+
+  static double parseBudget() {
+    if (overheadBudget.empty())
+      return -1.0;
+    StringRef budget(overheadBudget);
+    double scale = 1.0;
+    if (budget.endswith("%")) {
+      budget = budget.drop_back();
+      scale = 0.01;
+    }
+    // Like cl::parser<double>, which needs a terminated string
+    std::string copy = budget.str();
+    const char *start = copy.c_str();
+    char *end;
+    double value = strtod(start, &end);
+    if (end == start || *end != 0 || value < 0.0) {
+      LLVMContext &ctx = getGlobalContext();
+      ctx.emitError("Profile: Invalid overhead budget " + overheadBudget);
+      return -1.0;
+    }
+    return value * scale;
+  }
+
+  // Disable the most expensive transformations until the estimated overhead
+  // over the whole profile fits in the budget. The plan only depends on the
+  // profile so every translation unit arrives at the same one
+  void plan(double budget) {
+    if (budget < 0.0)
+      return;
+
+    uint64_t baseline = 0;
+    DenseSet<uint64_t> functions;
+    for (auto &entry : counts) {
+      functions.insert(entry.first & ~7ULL);
+      if ((entry.first & 7) == ObfProfile::BaseSite)
+        baseline += entry.second;
+    }
+
+    std::vector<std::pair<uint64_t, uint64_t> > costs;
+    uint64_t total = 0;
+    for (uint64_t function : functions) {
+      uint64_t flatten = count(function, ObfProfile::FlattenSite);
+      uint64_t opaque = count(function, ObfProfile::OpaqueSite);
+      uint64_t bogus = count(function, ObfProfile::BogusCFSite);
+      // Predicates not coming from BogusCF splits come from loop headers
+      uint64_t loop = opaque > bogus ? opaque - bogus : 0;
+
+      costs.push_back(std::make_pair(flatten * flattenCost,
+                                     function | ObfProfile::FlattenSite));
+      costs.push_back(std::make_pair(bogus * (predicateCost + 1),
+                                     function | ObfProfile::BogusCFSite));
+      costs.push_back(std::make_pair(loop * (predicateCost + 1),
+                                     function | ObfProfile::LoopBogusCFSite));
+    }
+    for (auto &cost : costs)
+      total += cost.first;
+
+    uint64_t allowed = (uint64_t)(budget * baseline);
+    DEBUG(errs() << "Profile: Baseline " << baseline << ", overhead " << total
+                 << ", allowed " << allowed << "\n");
+
+    std::sort(costs.begin(), costs.end(),
+              std::greater<std::pair<uint64_t, uint64_t> >());
+    for (auto &cost : costs) {
+      if (total <= allowed || cost.first == 0)
+        break;
+      DEBUG(errs() << "\tDisabling key " << cost.second << " (cost "
+                   << cost.first << ")\n");
+      disabled.insert(cost.second);
+      total -= cost.first;
+      ++NumDisabled;
+    }
+  }
+};
+};
+
+namespace ObfProfile {
+bool isGenerating() { return profileGenerate; }
+
+void instrument(BasicBlock *block, SiteKind kind, unsigned weight) {
+  Function *F = block->getParent();
+  Module *M = F->getParent();
+  LLVMContext &context = M->getContext();
+  Type *intType = Type::getInt64Ty(context);
+
+  GlobalVariable *counter =
+      new GlobalVariable(*M, intType, false, GlobalValue::PrivateLinkage,
+                         ConstantInt::get(intType, 0), "");
+  Instruction *insertPoint = block->getFirstInsertionPt();
+  LoadInst *load = new LoadInst(counter, "", insertPoint);
+  Value *add = BinaryOperator::Create(Instruction::Add, load,
+                                      ConstantInt::get(intType, weight), "",
+                                      insertPoint);
+  new StoreInst(add, counter, insertPoint);
+
+  // Counters are collected into one array by ProfileFinalize
+  Value *site[] = { counter,
+                    ConstantInt::get(intType, getKey(F->getName(), kind)) };
+  M->getOrInsertNamedMetadata(sitesName)
+      ->addOperand(MDNode::get(context, site));
+  ++NumSites;
+}
+
+bool isAllowed(Function &F, SiteKind kind) {
+  if (profileUse.empty())
+    return true;
+  static Plan plan;
+  if (plan.disabled.count(getKey(F.getName(), kind))) {
+    DEBUG(errs() << "Profile: " << F.getName()
+                 << " -- transformation over budget\n");
+    return false;
+  }
+  return true;
+}
+};
+
+bool ProfileInstrument::runOnFunction(Function &F) {
+  if (!profileGenerate || F.isDeclaration())
+    return false;
+
+  // Sizes are taken before any counter is added
+  std::vector<std::pair<BasicBlock *, unsigned> > blocks;
+  for (auto &block : F) {
+    blocks.push_back(std::make_pair(&block, (unsigned)block.size()));
+  }
+  for (auto &block : blocks) {
+    ObfProfile::instrument(block.first, ObfProfile::BaseSite, block.second);
+  }
+  return true;
+}
+
+bool ProfileFinalize::runOnModule(Module &M) {
+  if (!profileGenerate)
+    return false;
+
+  NamedMDNode *sites = M.getNamedMetadata(sitesName);
+  if (!sites)
+    return false;
+
+  LLVMContext &context = M.getContext();
+  Type *intType = Type::getInt64Ty(context);
+  std::vector<GlobalVariable *> counters;
+  std::vector<Constant *> keys;
+  for (unsigned i = 0, iEnd = sites->getNumOperands(); i < iEnd; ++i) {
+    MDNode *site = sites->getOperand(i);
+    // Counters of deleted functions are gone
+    GlobalVariable *counter =
+        dyn_cast_or_null<GlobalVariable>(site->getOperand(0));
+    if (!counter)
+      continue;
+    counters.push_back(counter);
+    keys.push_back(cast<Constant>(site->getOperand(1)));
+  }
+  M.eraseNamedMetadata(sites);
+  DEBUG(errs() << "Profile: " << counters.size() << " counters\n");
+  if (counters.empty())
+    return true;
+
+  // Move the counters into one array that is written out as it is
+  unsigned n = counters.size();
+  ArrayType *keysType = ArrayType::get(intType, n);
+  GlobalVariable *countersTable = new GlobalVariable(
+      M, keysType, false, GlobalValue::PrivateLinkage,
+      ConstantAggregateZero::get(keysType), "");
+  for (unsigned i = 0; i < n; ++i) {
+    Constant *indices[] = { ConstantInt::get(intType, 0),
+                            ConstantInt::get(intType, i) };
+    counters[i]->replaceAllUsesWith(
+        ConstantExpr::getInBoundsGetElementPtr(countersTable, indices));
+    counters[i]->eraseFromParent();
+  }
+
+  GlobalVariable *keysTable = new GlobalVariable(
+      M, keysType, true, GlobalValue::PrivateLinkage,
+      ConstantArray::get(keysType, keys), "");
+  Constant *header[] = { ConstantInt::get(intType, profileMagic),
+                         ConstantInt::get(intType, n) };
+  ArrayType *headerType = ArrayType::get(intType, 2);
+  GlobalVariable *headerTable = new GlobalVariable(
+      M, headerType, true, GlobalValue::PrivateLinkage,
+      ConstantArray::get(headerType, header), "");
+
+  // libc declarations. FILE * is treated as i8 *
+  DataLayout layout(&M);
+  Type *sizeType = layout.getIntPtrType(context);
+  Type *bytePtr = Type::getInt8PtrTy(context);
+  Type *voidType = Type::getVoidTy(context);
+  Constant *fopenFunc = M.getOrInsertFunction("fopen", bytePtr, bytePtr,
+                                              bytePtr, nullptr);
+  Constant *fwriteFunc = M.getOrInsertFunction(
+      "fwrite", sizeType, bytePtr, sizeType, sizeType, bytePtr, nullptr);
+  Constant *fcloseFunc = M.getOrInsertFunction(
+      "fclose", Type::getInt32Ty(context), bytePtr, nullptr);
+  FunctionType *dumpType = FunctionType::get(voidType, false);
+  Constant *atexitFunc =
+      M.getOrInsertFunction("atexit", Type::getInt32Ty(context),
+                            PointerType::getUnqual(dumpType), nullptr);
+
+  // void dump(): append the counters to the profile
+  Function *dump = Function::Create(dumpType, GlobalValue::InternalLinkage,
+                                    "__obf_profile_dump", &M);
+  BasicBlock *dumpBlock = BasicBlock::Create(context, "", dump);
+  BasicBlock *writeBlock = BasicBlock::Create(context, "", dump);
+  BasicBlock *returnBlock = BasicBlock::Create(context, "", dump);
+  IRBuilder<> builder(dumpBlock);
+  Value *file = builder.CreateCall2(fopenFunc,
+                                    builder.CreateGlobalStringPtr(profileFile),
+                                    builder.CreateGlobalStringPtr("ab"));
+  builder.CreateCondBr(builder.CreateIsNull(file), returnBlock, writeBlock);
+
+  builder.SetInsertPoint(writeBlock);
+  Value *eight = ConstantInt::get(sizeType, 8);
+  Value *count = ConstantInt::get(sizeType, n);
+  builder.CreateCall4(fwriteFunc,
+                      builder.CreatePointerCast(headerTable, bytePtr), eight,
+                      ConstantInt::get(sizeType, 2), file);
+  builder.CreateCall4(fwriteFunc, builder.CreatePointerCast(keysTable, bytePtr),
+                      eight, count, file);
+  builder.CreateCall4(fwriteFunc,
+                      builder.CreatePointerCast(countersTable, bytePtr), eight,
+                      count, file);
+  builder.CreateCall(fcloseFunc, file);
+  builder.CreateBr(returnBlock);
+
+  builder.SetInsertPoint(returnBlock);
+  builder.CreateRetVoid();
+
+  // Register dump at start up
+  Function *init = Function::Create(dumpType, GlobalValue::InternalLinkage,
+                                    "__obf_profile_init", &M);
+  builder.SetInsertPoint(BasicBlock::Create(context, "", init));
+  builder.CreateCall(atexitFunc, dump);
+  builder.CreateRetVoid();
+  appendToGlobalCtors(M, init, 0);
+
+  return true;
+}
+
+char ProfileInstrument::ID = 0;
+static RegisterPass<ProfileInstrument>
+    X("profile-instrument", "Count instructions executed by basic blocks",
+      false, false);
+
+char ProfileFinalize::ID = 0;
+static RegisterPass<ProfileFinalize>
+    Y("profile-finalize", "Write obfuscation profile counters at exit", false,
+      false);
@@ -22,14 +22,13 @@
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include <algorithm>
 #include <random>
-#include <chrono>
 #include <climits>
 #include <utility>
 #include <vector>
 
 static cl::opt<std::string> replaceSeed(
     "replaceSeed", cl::init(""),
-    cl::desc("Seed for random number generator. Defaults to system time"));
+    cl::desc("Seed for random number generator. Defaults to -obf-seed"));
 
 static cl::opt<bool>
     disableReplaceInst("disableReplaceInst", cl::init(false),
@@ -71,6 +70,12 @@ static unsigned floatCompare[floatCompareSize] = {
 };
 }
 
+bool ReplaceInstruction::doInitialization(Function &F) {
+  // One stream per function rather than a fresh engine for every block
+  engine = ObfUtils::getEngine("replace-instruction", replaceSeed, F);
+  return false;
+}
+
 bool ReplaceInstruction::runOnBasicBlock(BasicBlock &block) {
   if (disableReplaceInst)
     return false;
@@ -82,16 +87,7 @@ bool ReplaceInstruction::runOnBasicBlock(BasicBlock &block) {
   DEBUG(errs() << "Unreachable Block: " << block.getName() << "\n");
   ++NumUnreachableBlocks;
 
-  std::mt19937_64 engine;
   std::uniform_int_distribution<int64_t> distribution;
-  // Seed engine and create distribution
-  if (!replaceSeed.empty()) {
-    std::seed_seq seed(replaceSeed.begin(), replaceSeed.end());
-    engine.seed(seed);
-  } else {
-    unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-    engine.seed(seed);
-  }
 
   bool hasBeenModified = false;
 
@@ -202,6 +198,11 @@ bool ReplaceInstruction::runOnBasicBlock(BasicBlock &block) {
   return hasBeenModified;
 }
 
+// Terminators are left alone
+void ReplaceInstruction::getAnalysisUsage(AnalysisUsage &AU) const {
+  AU.setPreservesCFG();
+}
+
 char ReplaceInstruction::ID = 0;
 static RegisterPass<ReplaceInstruction> X(
     "replace-instruction",
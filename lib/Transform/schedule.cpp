@@ -6,6 +6,7 @@
 // License. See LICENSE.TXT for details.
 //
 //===----------------------------------------------------------------------===//
+#define DEBUG_TYPE "schedule"
 #include "Transform/boguscf.h"
 #include "Transform/cleanup.h"
 #include "Transform/copy.h"
@@ -13,12 +14,18 @@
 #include "Transform/identifier_renamer.h"
 #include "Transform/inline_function.h"
 #include "Transform/loop_boguscf.h"
+#include "Transform/obf_utilities.h"
 #include "Transform/opaque_predicate.h"
 #include "Transform/metrics.h"
+#include "Transform/profile.h"
 #include "Transform/replace_instruction.h"
 #include "llvm/LinkAllPasses.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <memory>
 #include <vector>
 
 using namespace llvm;
@@ -65,8 +72,164 @@ cl::list<ScheduleOptions> ObfuscationList(
                clEnumVal(identifierRenamerPass, "Rename identifiers"),
                clEnumValEnd));
 
+static cl::opt<bool>
+    obfTimeStages("obf-time-stages", cl::init(false),
+                  cl::desc("Time every stage of the obfuscation pipeline"));
+
 namespace {
 
+// Forms of the IR that passes in the pipeline depend on
+enum IRForm {
+  // Values demoted by obfuscation passes that PromoteDemoted can promote
+  PendingSlots = 1 << 0,
+  // Every loop is in loop simplify form
+  LoopSimplifyForm = 1 << 1,
+  // Stub branches that OpaquePredicate has yet to turn into predicates
+  PendingStubs = 1 << 2
+};
+
+// What a requested pass needs from the IR and how it changes it
+struct StageInfo {
+  StringRef name;
+  // Forms that have to hold before the pass runs
+  unsigned requires;
+  // Forms that must not hold
+  unsigned forbids;
+  // Forms that hold after the pass
+  unsigned creates;
+  // Forms the pass destroys
+  unsigned invalidates;
+};
+
+const StageInfo &getStageInfo(ScheduleOptions option) {
+  static const StageInfo stages[] = {
+    // copyPass. Clones of demoted slots would not be promoted
+    { "copy", 0, PendingSlots, 0, 0 },
+    // inlineFunctionPass. Same for inlined slots
+    { "inline-function", 0, PendingSlots, 0, LoopSimplifyForm },
+    // bogusCFPass. Demotes what it needs to by itself
+    { "boguscf", 0, 0, PendingSlots | PendingStubs, LoopSimplifyForm },
+    // loopBCFPass. ScalarEvolution cannot see through stack slots
+    { "loop-boguscf", LoopSimplifyForm, PendingSlots, PendingStubs, 0 },
+    // opaquePredicatePass
+    { "opaque-predicate", 0, 0, 0, PendingStubs },
+    // replaceInstructionPass
+    { "replace-instruction", 0, 0, 0, 0 },
+    // flattenPass. Rewrites the terminators that hold stubs
+    { "flatten", 0, PendingStubs, PendingSlots, LoopSimplifyForm },
+    // cleanupPass
+    { "cleanup", 0, 0, 0, 0 },
+    // identifierRenamerPass
+    { "identifier-renamer", 0, 0, 0, 0 }
+  };
+  return stages[option];
+}
+
+Pass *createObfuscationPass(ScheduleOptions option) {
+  switch (option) {
+  case copyPass:
+    return new Copy();
+  case inlineFunctionPass:
+    return new InlineFunctionPass();
+  case bogusCFPass:
+    return new BogusCF();
+  case loopBCFPass:
+    return new LoopBogusCF();
+  case opaquePredicatePass:
+    return new OpaquePredicate();
+  case replaceInstructionPass:
+    return new ReplaceInstruction();
+  case flattenPass:
+    return new Flatten();
+  case cleanupPass:
+    return new CleanupPass();
+  case identifierRenamerPass:
+    return new IdentifierRenamer();
+  default:
+    llvm_unreachable("Unknown option set");
+  }
+}
+
+// Starts or stops the timer of a pipeline stage
+struct StageTimer : public ModulePass {
+  static char ID;
+  Timer *timer;
+  bool start;
+
+  StageTimer(Timer *timer, bool start)
+      : ModulePass(ID), timer(timer), start(start) {}
+  virtual bool runOnModule(Module &M) {
+    if (start)
+      timer->startTimer();
+    else
+      timer->stopTimer();
+    return false;
+  }
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const {
+    AU.setPreservesAll();
+  }
+};
+char StageTimer::ID = 0;
+
+// Append the passes of a stage, between timers with -obf-time-stages
+void addStage(std::vector<Pass *> &passes, StringRef name,
+              const std::vector<Pass *> &stage) {
+  DEBUG(errs() << "Schedule: Stage " << name << ", " << stage.size()
+               << " passes\n");
+  if (!obfTimeStages) {
+    passes.insert(passes.end(), stage.begin(), stage.end());
+    return;
+  }
+  // Reported when the group goes away at exit
+  static TimerGroup group("Obfuscation pipeline stages");
+  static std::vector<std::unique_ptr<Timer> > timers;
+  timers.emplace_back(new Timer(name, group));
+  passes.push_back(new StageTimer(timers.back().get(), true));
+  passes.insert(passes.end(), stage.begin(), stage.end());
+  passes.push_back(new StageTimer(timers.back().get(), false));
+}
+
+// Schedule the passes of options in order. Each one is preceded by the passes
+// that bring the IR into the form it needs, but only if an earlier pass has
+// not already done so and nothing has destroyed it since. Stubs left for a
+// pass that would lose them are resolved by an OpaquePredicate first
+void planPipeline(std::vector<Pass *> &passes,
+                  ArrayRef<ScheduleOptions> options) {
+  unsigned form = 0;
+  for (auto option : options) {
+    const StageInfo &info = getStageInfo(option);
+    std::vector<Pass *> stage;
+
+    unsigned forbidden = form & info.forbids;
+    if (forbidden & PendingStubs) {
+      stage.push_back(new OpaquePredicate());
+      form &= ~PendingStubs;
+    }
+    if (forbidden & PendingSlots) {
+      stage.push_back(new PromoteDemoted());
+      form &= ~PendingSlots;
+    }
+
+    unsigned missing = info.requires & ~form;
+    if (missing & LoopSimplifyForm)
+      stage.push_back(createLoopSimplifyPass());
+    form |= missing;
+
+    stage.push_back(createObfuscationPass(option));
+    form = (form & ~info.invalidates) | info.creates;
+    addStage(passes, info.name, stage);
+  }
+
+  // Clean ups
+  std::vector<Pass *> stage;
+  if (form & PendingStubs)
+    stage.push_back(new OpaquePredicate());
+  if (form & PendingSlots)
+    stage.push_back(new PromoteDemoted());
+  stage.push_back(createCFGSimplificationPass());         // Further cleanups
+  addStage(passes, "final-cleanup", stage);
+}
+
 std::vector<Pass *> getPasses() {
   std::vector<Pass *> passes;
 
@@ -76,86 +239,46 @@ std::vector<Pass *> getPasses() {
     passes.push_back(new CleanupPass());
     passes.push_back(new IdentifierRenamer());
   } else if (!ObfuscationList.empty()) {
-    // Then we should schedule some passes required by the things below
-    passes.push_back(createDemoteRegisterToMemoryPass());
-
-    for (auto option : ObfuscationList) {
-      switch (option) {
-      case copyPass:
-        passes.push_back(new Copy());
-        break;
-      case inlineFunctionPass:
-        passes.push_back(new InlineFunctionPass());
-        break;
-      case bogusCFPass:
-        passes.push_back(new BogusCF());
-        break;
-      case loopBCFPass:
-        passes.push_back(createLoopSimplifyPass());
-        passes.push_back(new LoopBogusCF());
-        break;
-      case opaquePredicatePass:
-        passes.push_back(new OpaquePredicate());
-        break;
-      case replaceInstructionPass:
-        passes.push_back(new ReplaceInstruction());
-        break;
-      case flattenPass:
-        passes.push_back(new Flatten());
-        break;
-      case cleanupPass:
-        passes.push_back(new CleanupPass());
-        break;
-      case identifierRenamerPass:
-        passes.push_back(new IdentifierRenamer());
-        break;
-      default:
-        llvm_unreachable("Unknown option set");
-      }
-
-      // Clean up pass
-      passes.push_back(createPromoteMemoryToRegisterPass()); // Fix PHI
-                                                             // demotions
-      passes.push_back(createCFGSimplificationPass());       // Further cleanups
-    }
+    planPipeline(passes, ObfuscationList);
   } else {
 
-    // Default Pass Set
-    // Demote PHIs to memory for ease of analysis
-    passes.push_back(createDemoteRegisterToMemoryPass());
-
-    // First batch of passes are trivial passes and should be run first to
-    // "maximise confusion" that the later passes will introduce
-    passes.push_back(new Copy());
-    passes.push_back(new InlineFunctionPass());
+    // Default Pass Set. The passes demote what they need to themselves and
+    // the planner promotes those slots again where later passes need
+    // registers, so that LoopBogusCF can compute trip counts
+    const ScheduleOptions defaults[] = {
+      // First batch of passes are trivial passes and should be run first to
+      // "maximise confusion" that the later passes will introduce
+      copyPass, inlineFunctionPass,
 
-    // Second batch of passes deal with introducing new control flow paths
-    // These passes will insert stub 1.00 == 1.00 branches
-    // which will be cleaned up by the OpaquePredicate pass
-    // OpaquePredicate pass MUST be run before Flatten Pass because Flatten
-    // will REMOVE the original branch instructions
-    passes.push_back(new BogusCF());
-    passes.push_back(createLoopSimplifyPass());
-    passes.push_back(new LoopBogusCF());
-    passes.push_back(new OpaquePredicate());
+      // Second batch of passes deal with introducing new control flow paths
+      // These passes will insert stub 1.00 == 1.00 branches
+      // which will be cleaned up by the OpaquePredicate pass
+      // OpaquePredicate pass MUST be run before Flatten Pass because Flatten
+      // will REMOVE the original branch instructions
+      bogusCFPass, loopBCFPass, opaquePredicatePass,
 
-    // The next pass will obfuscated unreachable blocks by introducing junk
-    passes.push_back(new ReplaceInstruction());
+      // The next pass will obfuscated unreachable blocks by introducing junk
+      replaceInstructionPass,
 
-    // Flatten the control flow
-    passes.push_back(new Flatten());
+      // Flatten the control flow
+      flattenPass,
 
-    // Clean ups
-    passes.push_back(new CleanupPass()); // Remove stray metadata left over from
-                                         // passes
-    passes.push_back(createPromoteMemoryToRegisterPass()); // Fix PHI demotions
-    passes.push_back(createCFGSimplificationPass());       // Further cleanups
+      // Remove stray metadata left over from passes
+      cleanupPass
+    };
+    planPipeline(passes, defaults);
 
     passes.push_back(new IdentifierRenamer());
     // passes.push_back(createStripDebugDeclarePass());
     // passes.push_back(createStripDeadDebugInfoPass());
   }
 
+  // Profile counters wrap around the whole obfuscation pipeline
+  if (ObfProfile::isGenerating()) {
+    passes.insert(passes.begin(), new ProfileInstrument());
+    passes.push_back(new ProfileFinalize());
+  }
+
   return passes;
 }
 }
@@ -0,0 +1,63 @@
+#!/bin/bash
+set -eu
+# Branch misses of flattened sorts with a shared and a threaded dispatcher
+# 1 - Shared dispatcher
+# 2 - Threaded dispatcher
+# Needs perf with access to hardware counters
+
+OUTPUT=branches.txt
+SIZE=${SIZE:-100000}
+SORTS=(mergesort quicksort radixsort bubblesort)
+STRATEGIES=(table direct switch)
+
+FLATTEN_FLAGS="-mllvm -flattenPass -mllvm -flattenProbability=1.0"
+
+FLAGS=(\
+    ""\
+    "-mllvm -flattenThreaded"\
+    )
+
+main() {
+    if [[ -n "${1+1}" ]]; then
+        OUTPUT=$1
+    fi
+
+    echo "Building..."
+    export OBF_FLAGS=""
+    make test/generator
+
+    tempdir=temp
+    rm -rf $tempdir
+    mkdir -p $tempdir
+    test/generator $SIZE > "$tempdir/input.txt"
+
+    echo "Writing results to $OUTPUT"
+    echo -e "\tbranches\tbranch-misses\tseconds" > $OUTPUT
+
+    for strategy in ${STRATEGIES[@]}; do
+        for ((i = 0; i < ${#FLAGS[@]}; i++)); do
+            flags="${FLAGS[$i]}"
+            make clean-obf
+            (export OBF_FLAGS="$FLATTEN_FLAGS\
+                -mllvm -flattenDispatch=$strategy $flags"; make)
+            echo "$strategy $flags" >> $OUTPUT
+
+            for sort in ${SORTS[@]}; do
+                echo -n "${sort}-obf" >> $OUTPUT
+                perf stat -x, -e branches,branch-misses -o "$tempdir/perf.txt"\
+                    "test/${sort}-obf" "$tempdir/input.txt" > /dev/null
+                for event in branches branch-misses; do
+                    echo -ne "\t" >> $OUTPUT
+                    grep ",$event" "$tempdir/perf.txt" | cut -d, -f1\
+                        | tr -d '\n' >> $OUTPUT
+                done
+                echo -ne "\t" >> $OUTPUT
+                (/usr/bin/time -f "%e" "test/${sort}-obf" "$tempdir/input.txt"\
+                        > /dev/null) 2>&1 | tr -d '\n' >> $OUTPUT
+                echo "" >> $OUTPUT
+            done
+        done
+    done
+}
+
+main "$@"
@@ -0,0 +1,79 @@
+#!/bin/bash
+set -eu
+# Two phase overhead budgeted obfuscation of the sorts
+# 1 - Instrumented build, training run to collect the profile
+# 2 - Rebuild within the overhead budget using the profile
+# Seeds are fixed so that both builds make the same random choices
+
+OUTPUT=budget.txt
+BUDGET=${BUDGET:-"5%"}
+TRAIN_SIZE=${TRAIN_SIZE:-10000}
+SIZES=(10000 100000 500000)
+SORTS=(mergesort quicksort)
+
+SEEDS="-mllvm -copySeed=1 -mllvm -inlineSeed=1 -mllvm -bcfSeed=1\
+    -mllvm -loopBcfSeed=1 -mllvm -opaque-seed=1 -mllvm -flattenSeed=1"
+OBF="$SEEDS -mllvm -flattenProbability=1.0 -mllvm -bcfProbability=1.0"
+
+run() {
+    local sort=$1
+    for size in ${SIZES[@]}; do
+        echo -ne "\t" >> $OUTPUT
+        (/usr/bin/time -f "%e" "test/$sort" "$tempdir/input-$size.txt"\
+                > "$tempdir/$sort-$size.txt") 2>&1 | tr '\n' ' ' >>  $OUTPUT
+    done
+    echo "" >> $OUTPUT
+}
+
+main() {
+    if [[ -n "${1+1}" ]]; then
+        OUTPUT=$1
+    fi
+
+    tempdir=temp
+    rm -rf $tempdir
+    mkdir -p $tempdir
+    profile="$(pwd)/$tempdir/obf.profdata"
+
+    echo "Generating sequences..."
+    make test/generator
+    test/generator $TRAIN_SIZE > "$tempdir/input-train.txt"
+    for size in ${SIZES[@]}; do
+        test/generator $size > "$tempdir/input-$size.txt"
+    done
+
+    echo "Writing results to $OUTPUT"
+    echo -e "budget $BUDGET\t${SIZES[*]}" > $OUTPUT
+
+    echo "Instrumented build..."
+    make clean-obf
+    (export OBF_FLAGS="$OBF -mllvm -obf-profile-generate\
+        -mllvm -obf-profile-file=$profile"; make)
+    for sort in ${SORTS[@]}; do
+        test/${sort}-obf "$tempdir/input-train.txt" > /dev/null
+    done
+
+    for sort in ${SORTS[@]}; do
+        echo -n "$sort" >> $OUTPUT
+        run $sort
+    done
+
+    echo "Unbudgeted build..."
+    make clean-obf
+    (export OBF_FLAGS="$OBF"; make)
+    for sort in ${SORTS[@]}; do
+        echo -n "${sort}-obf" >> $OUTPUT
+        run ${sort}-obf
+    done
+
+    echo "Budgeted build..."
+    make clean-obf
+    (export OBF_FLAGS="$OBF -mllvm -obf-profile-use=$profile\
+        -mllvm -obf-overhead-budget=$BUDGET"; make)
+    for sort in ${SORTS[@]}; do
+        echo -n "${sort}-budget" >> $OUTPUT
+        run ${sort}-obf
+    done
+}
+
+main "$@"
@@ -0,0 +1,70 @@
+#!/bin/bash
+set -eu
+# Compare the Flatten dispatcher strategies on the sorts
+# 1 - table
+# 2 - switch
+# 3 - direct
+
+OUTPUT=dispatch.txt
+SIZES=(10000 50000 100000 500000)
+SORTS=(mergesort quicksort radixsort bubblesort)
+STRATEGIES=(table switch direct)
+
+FLATTEN_FLAGS="-mllvm -flattenPass -mllvm -flattenProbability=1.0"
+
+main() {
+    if [[ -n "${1+1}" ]]; then
+        OUTPUT=$1
+    fi
+
+    echo "Building..."
+    export OBF_FLAGS=""
+    make
+
+    echo "Writing results to $OUTPUT"
+    echo -n "" > $OUTPUT
+
+    tempdir=temp
+    rm -rf $tempdir
+    mkdir -p $tempdir
+
+    echo "Generating sequences..."
+    for size in ${SIZES[@]}; do
+        echo -e "\t$size"
+        test/generator $size > "$tempdir/input-$size.txt"
+        echo -ne "\t$size" >> $OUTPUT
+    done
+    echo "" >> $OUTPUT
+
+    for sort in ${SORTS[@]}; do
+        echo -n "$sort" >> $OUTPUT
+        for size in ${SIZES[@]}; do
+            echo -ne "\t" >> $OUTPUT
+            (/usr/bin/time -f "%e" "test/$sort" "$tempdir/input-$size.txt"\
+                    > "$tempdir/$sort-$size.txt") 2>&1 | tr '\n' ' ' >>  $OUTPUT
+        done
+        echo "" >> $OUTPUT
+    done
+
+    for strategy in ${STRATEGIES[@]}; do
+        make clean-obf
+        (export OBF_FLAGS="$FLATTEN_FLAGS -mllvm -flattenDispatch=$strategy";\
+            make)
+        echo "$strategy" >> $OUTPUT
+
+        for sort in ${SORTS[@]}; do
+            echo -n "${sort}-obf" >> $OUTPUT
+            for size in ${SIZES[@]}; do
+                echo -ne "\t" >> $OUTPUT
+                (/usr/bin/time -f "%e" "test/${sort}-obf" "$tempdir/input-$size.txt"\
+                        > "$tempdir/obf-$sort-$size.txt") 2>&1 | tr '\n' ' ' >>  $OUTPUT
+
+                diff "$tempdir/obf-$sort-$size.txt" "$tempdir/$sort-$size.txt"\
+                 > /dev/null || echo -ne " DIFFER" >> $OUTPUT
+            done
+            echo "" >> $OUTPUT
+        done
+    done
+}
+
+main "$@"
@@ -0,0 +1,55 @@
+#!/bin/bash
+set -eu
+# Compile time of very large flattened functions with a limited dispatcher
+# fan-out. 0 means a single dispatcher
+
+OUTPUT=fanout.txt
+SIZES=(1000 5000 20000)
+FANOUTS=(0 1024 256 64)
+
+CPP_FLAGS="-O2 -std=c++11 -c"
+FLATTEN_FLAGS="-mllvm -flattenPass -mllvm -flattenProbability=1.0"
+
+# One function with about 3 basic blocks per statement
+generate() {
+    local size=$1
+    echo "int large(int x, int y) {"
+    for ((i = 0; i < $size; i++)); do
+        echo "  if ((x ^ $i) & 1) y += x * $i; else y ^= $i;"
+        echo "  x = y - x;"
+    done
+    echo "  return y;"
+    echo "}"
+}
+
+main() {
+    if [[ -n "${1+1}" ]]; then
+        OUTPUT=$1
+    fi
+
+    tempdir=temp
+    rm -rf $tempdir
+    mkdir -p $tempdir
+
+    echo "Writing results to $OUTPUT"
+    echo -n "" > $OUTPUT
+    for size in ${SIZES[@]}; do
+        generate $size > "$tempdir/large-$size.cpp"
+        echo -ne "\t$size" >> $OUTPUT
+    done
+    echo "" >> $OUTPUT
+
+    for fanout in ${FANOUTS[@]}; do
+        echo -n "$fanout" >> $OUTPUT
+        for size in ${SIZES[@]}; do
+            echo -ne "\t" >> $OUTPUT
+            (/usr/bin/time -f "%e" ./obf.sh $CPP_FLAGS $FLATTEN_FLAGS\
+                -mllvm -flattenMaxFanOut=$fanout\
+                -o "$tempdir/large-$size.o" "$tempdir/large-$size.cpp")\
+                2>&1 | tr -d '\n' >> $OUTPUT
+        done
+        echo "" >> $OUTPUT
+    done
+}
+
+main "$@"
@@ -0,0 +1,70 @@
+#!/bin/bash
+set -eu
+# Text size and run time of BogusCF with per-block clones against shared decoy
+# pools
+# 1 - Clones
+# 2.. - Decoy pools of different sizes
+
+OUTPUT=footprint.txt
+SIZE=500000
+SORTS=(mergesort quicksort radixsort bubblesort)
+BCF_FLAGS="-mllvm -bogusCFPass -mllvm -opaquePredicatePass\
+    -mllvm -bcfProbability=1.0"
+
+FLAGS=(\
+    ""\
+    "-mllvm -bcfDecoyPool=4"\
+    "-mllvm -bcfDecoyPool=16"\
+    "-mllvm -bcfDecoyPool=16 -mllvm -bcfDecoyReuse=4"\
+    )
+
+main() {
+    if [[ -n "${1+1}" ]]; then
+        OUTPUT=$1
+    fi
+
+    echo "Building..."
+    export OBF_FLAGS=""
+    make
+
+    echo "Writing results to $OUTPUT"
+    echo -n "" > $OUTPUT
+
+    tempdir=temp
+    rm -rf $tempdir
+    mkdir -p $tempdir
+    test/generator $SIZE > "$tempdir/input.txt"
+
+    for sort in ${SORTS[@]}; do
+        echo -ne "\t$sort text\t$sort (s)" >> $OUTPUT
+    done
+    echo "" >> $OUTPUT
+
+    echo -n "none" >> $OUTPUT
+    for sort in ${SORTS[@]}; do
+        echo -ne "\t$(size -A "test/$sort" | awk '/^.text/ {print $2}')\t"\
+            >> $OUTPUT
+        (/usr/bin/time -f "%e" "test/$sort" "$tempdir/input.txt"\
+            > "$tempdir/$sort.txt") 2>&1 | tr -d '\n' >> $OUTPUT
+    done
+    echo "" >> $OUTPUT
+
+    for ((i = 0; i < ${#FLAGS[@]}; i++)); do
+        flags="${FLAGS[$i]}"
+        make clean-obf
+        (export OBF_FLAGS="$BCF_FLAGS $flags"; make)
+        echo -n "bcf $flags" >> $OUTPUT
+
+        for sort in ${SORTS[@]}; do
+            echo -ne "\t$(size -A "test/${sort}-obf" | awk '/^.text/ {print $2}')\t"\
+                >> $OUTPUT
+            (/usr/bin/time -f "%e" "test/${sort}-obf" "$tempdir/input.txt"\
+                > "$tempdir/obf-$sort.txt") 2>&1 | tr -d '\n' >> $OUTPUT
+            diff "$tempdir/obf-$sort.txt" "$tempdir/$sort.txt" > /dev/null\
+                || echo -ne " DIFFER" >> $OUTPUT
+        done
+        echo "" >> $OUTPUT
+    done
+}
+
+main "$@"
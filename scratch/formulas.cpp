@@ -0,0 +1,33 @@
+// Fixed kernel for timing opaque predicate formulae. formulas.sh builds it
+// once without obfuscation and once with every formula forced through
+// -opaque-formula, then compares cycles per iteration. kernel() is not
+// mangled so that it can be selected with -bcfFunc
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <x86intrin.h>
+
+extern "C" unsigned kernel(unsigned count, unsigned seed) {
+  unsigned value = seed, sum = 0;
+  for (unsigned i = 0; i < count; ++i) {
+    if (value & 1)
+      value = value * 3 + 1;
+    else
+      value >>= 1;
+    if (value < 2)
+      value = seed + i;
+    sum += value;
+  }
+  return sum;
+}
+
+int main(int argc, char **argv) {
+  unsigned count = argc > 1 ? atoi(argv[1]) : 10000000;
+
+  uint64_t start = __rdtsc();
+  unsigned result = kernel(count, 27);
+  uint64_t cycles = __rdtsc() - start;
+  std::cerr << result << "\n";
+  std::cout << (double)cycles / count << "\n";
+  return 0;
+}
@@ -0,0 +1,39 @@
+#!/bin/bash
+set -eu
+# Cycles per iteration of a fixed kernel with every block behind an opaque
+# predicate, for each formula OpaquePredicate can emit
+
+OUTPUT=formulas.txt
+COUNT=10000000
+FORMULAS=(0 1 2 3 4 5)
+
+CPP=build/Release+Asserts/bin/clang++
+CPP_FLAGS="-O2 -std=c++11"
+BCF_FLAGS="-mllvm -bogusCFPass -mllvm -opaquePredicatePass\
+    -mllvm -bcfProbability=1.0 -mllvm -bcfFunc=kernel"
+
+main() {
+    if [[ -n "${1+1}" ]]; then
+        OUTPUT=$1
+    fi
+
+    tempdir=temp
+    rm -rf $tempdir
+    mkdir -p $tempdir
+
+    echo "Writing results to $OUTPUT"
+    echo -e "\tcycles" > $OUTPUT
+
+    $CPP $CPP_FLAGS -o "$tempdir/formulas" formulas.cpp
+    echo -ne "none\t" >> $OUTPUT
+    "$tempdir/formulas" $COUNT 2> /dev/null >> $OUTPUT
+
+    for formula in ${FORMULAS[@]}; do
+        ./obf.sh $CPP_FLAGS $BCF_FLAGS -mllvm -opaque-formula=$formula\
+            -o "$tempdir/formulas-$formula" formulas.cpp
+        echo -ne "formula$formula\t" >> $OUTPUT
+        "$tempdir/formulas-$formula" $COUNT 2> /dev/null >> $OUTPUT
+    done
+}
+
+main "$@"
@@ -0,0 +1,79 @@
+#!/bin/bash
+set -eu
+# Dynamic relocations and start up time of a large flattened PIE
+# 1 - Not obfuscated
+# 2 - Absolute jump tables
+# 3 - Relative jump tables
+
+OUTPUT=relocations.txt
+FUNCTIONS=${FUNCTIONS:-2000}
+RUNS=${RUNS:-1000}
+
+CPP=build/Release+Asserts/bin/clang++
+CPP_FLAGS="-O2 -std=c++11 -fPIE -pie"
+FLATTEN_FLAGS="-mllvm -flattenPass -mllvm -flattenProbability=1.0"
+
+FLAGS=(\
+    "$FLATTEN_FLAGS -mllvm -flattenDispatch=table"\
+    "$FLATTEN_FLAGS -mllvm -flattenDispatch=relative"\
+    )
+
+# Many small functions with enough branches to be flattened
+generate() {
+    echo "#include <cstdlib>"
+    for ((i = 0; i < $FUNCTIONS; i++)); do
+        echo "int f$i(int x) {"
+        echo "  int y = 0;"
+        echo "  for (int i = 0; i < x; ++i) {"
+        echo "    if (i % 3 == $((i % 3))) y += i; else y -= $i;"
+        echo "    if (y > $i) y /= 2;"
+        echo "  }"
+        echo "  return y;"
+        echo "}"
+    done
+    echo "int main(int argc, char **argv) {"
+    echo "  if (argc < 2) return 0;"
+    echo "  int x = atoi(argv[1]), y = 0;"
+    for ((i = 0; i < $FUNCTIONS; i++)); do
+        echo "  y += f$i(x);"
+    done
+    echo "  return y & 1;"
+    echo "}"
+}
+
+measure() {
+    local binary=$1
+    echo -ne "\t$(readelf -rW $binary | grep -c R_X86_64_RELATIVE)" >> $OUTPUT
+    echo -ne "\t$(size -A $binary | awk '/.data.rel.ro/ {print $2}')" >> $OUTPUT
+    echo -ne "\t" >> $OUTPUT
+    (/usr/bin/time -f "%e" bash -c "for ((i = 0; i < $RUNS; i++)); do\
+        $binary; done") 2>&1 | tr -d '\n' >> $OUTPUT
+    echo "" >> $OUTPUT
+}
+
+main() {
+    if [[ -n "${1+1}" ]]; then
+        OUTPUT=$1
+    fi
+
+    tempdir=temp
+    rm -rf $tempdir
+    mkdir -p $tempdir
+    generate > "$tempdir/large.cpp"
+
+    echo "Writing results to $OUTPUT"
+    echo -e "\trelative relocs\t.data.rel.ro\t$RUNS starts (s)" > $OUTPUT
+
+    $CPP $CPP_FLAGS -o "$tempdir/large" "$tempdir/large.cpp"
+    echo -n "large" >> $OUTPUT
+    measure "$tempdir/large"
+
+    for ((i = 0; i < ${#FLAGS[@]}; i++)); do
+        flags="${FLAGS[$i]}"
+        ./obf.sh $CPP_FLAGS $flags -o "$tempdir/large-obf" "$tempdir/large.cpp"
+        echo -n "$flags" >> $OUTPUT
+        measure "$tempdir/large-obf"
+    done
+}
+
+main "$@"
@@ -0,0 +1,82 @@
+#!/bin/bash
+set -eu
+# Compile time scaling of Flatten on synthetic IR. The time per block should
+# stay roughly constant as the function grows
+
+OUTPUT=scaling.txt
+BLOCKS=(1000 10000 100000)
+
+LLVM_BUILD="build/Release+Asserts"
+OBF_BASE="build/projects/LLVM-Obfuscator"
+OBF_BUILD="build/projects/LLVM-Obfuscator/Release+Asserts"
+OPT="${LLVM_BUILD}/bin/opt -load ${OBF_BUILD}/lib/LLVMObfuscatorTransforms.so"
+FLATTEN_FLAGS="-flatten -flattenProbability=1.0"
+
+FLAGS=(\
+    ""\
+    "-flattenThreaded"\
+    "-flattenSSA"\
+    )
+
+# A chain of diamonds with 4 blocks each. Every diamond has a PHI node and
+# values used across blocks
+generate() {
+    awk -v steps=$(($1 / 4)) 'BEGIN {
+        print "define i32 @large(i32 %x) {"
+        print "entry:"
+        print "  br label %s0"
+        for (i = 0; i < steps; i++) {
+            prev = i ? "%p" (i - 1) : "%x"
+            print "s" i ":"
+            print "  %v" i " = add i32 " prev ", " i
+            print "  %c" i " = icmp ult i32 %v" i ", " (i * 7919) % 65536
+            print "  br i1 %c" i ", label %t" i ", label %f" i
+            print "t" i ":"
+            print "  %a" i " = mul i32 %v" i ", 3"
+            print "  br label %j" i
+            print "f" i ":"
+            print "  %b" i " = xor i32 %v" i ", " i
+            print "  br label %j" i
+            print "j" i ":"
+            print "  %p" i " = phi i32 [ %a" i ", %t" i " ], [ %b" i ", %f" i " ]"
+            print "  br label %s" (i + 1)
+        }
+        print "s" steps ":"
+        print "  ret i32 %p" (steps - 1)
+        print "}"
+    }'
+}
+
+main() {
+    if [[ -n "${1+1}" ]]; then
+        OUTPUT=$1
+    fi
+
+    (cd ${OBF_BASE} && make > /dev/null)
+
+    tempdir=temp
+    rm -rf $tempdir
+    mkdir -p $tempdir
+
+    echo "Writing results to $OUTPUT"
+    echo -n "" > $OUTPUT
+    for blocks in ${BLOCKS[@]}; do
+        generate $blocks > "$tempdir/large-$blocks.ll"
+        echo -ne "\t$blocks\tus/block" >> $OUTPUT
+    done
+    echo "" >> $OUTPUT
+
+    for ((i = 0; i < ${#FLAGS[@]}; i++)); do
+        flags="${FLAGS[$i]}"
+        echo -n "flatten $flags" >> $OUTPUT
+        for blocks in ${BLOCKS[@]}; do
+            seconds=$( (/usr/bin/time -f "%e" $OPT $FLATTEN_FLAGS $flags\
+                -o /dev/null "$tempdir/large-$blocks.ll") 2>&1 | tail -n 1)
+            echo -ne "\t$seconds" >> $OUTPUT
+            echo -ne "\t$(echo "$seconds * 1000000 / $blocks" | bc)" >> $OUTPUT
+        done
+        echo "" >> $OUTPUT
+    done
+}
+
+main "$@"
@@ -0,0 +1,43 @@
+// Every thread runs the same branchy loop so that opaque predicates inserted
+// into work() are evaluated concurrently on all cores. work() is not mangled
+// so that threads.sh can select it with -bcfFunc
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+extern "C" unsigned work(unsigned iterations, unsigned seed) {
+  unsigned value = seed;
+  for (unsigned i = 0; i < iterations; ++i) {
+    if (value & 1)
+      value = value * 3 + 1;
+    else
+      value >>= 1;
+    if (value < 2)
+      value = seed + i;
+  }
+  return value;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    std::cerr << "Usage: threads threads iterations_per_thread\n";
+    return 1;
+  }
+  unsigned threads = atoi(argv[1]), iterations = atoi(argv[2]);
+
+  std::vector<std::thread> pool;
+  std::vector<unsigned> results(threads);
+  for (unsigned i = 0; i < threads; ++i) {
+    pool.push_back(std::thread([&, i] {
+      results[i] = work(iterations, i + 27);
+    }));
+  }
+  unsigned total = 0;
+  for (unsigned i = 0; i < threads; ++i) {
+    pool[i].join();
+    total += results[i];
+  }
+  std::cout << total << "\n";
+  return 0;
+}
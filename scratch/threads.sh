@@ -0,0 +1,54 @@
+#!/bin/bash
+set -eu
+# Scaling of opaque predicates with threads for each storage of their state.
+# Every thread does the same amount of work, so times should stay flat
+
+OUTPUT=threads.txt
+ITERATIONS=100000000
+THREADS=(1 2 4 8)
+STATES=(shared padded thread-local)
+
+CPP=build/Release+Asserts/bin/clang++
+CPP_FLAGS="-O2 -std=c++11 -pthread"
+BCF_FLAGS="-mllvm -bogusCFPass -mllvm -opaquePredicatePass\
+    -mllvm -bcfProbability=1.0 -mllvm -bcfFunc=work"
+
+measure() {
+    local binary=$1
+    for threads in ${THREADS[@]}; do
+        echo -ne "\t" >> $OUTPUT
+        (/usr/bin/time -f "%e" $binary $threads $ITERATIONS > /dev/null)\
+            2>&1 | tr -d '\n' >> $OUTPUT
+    done
+    echo "" >> $OUTPUT
+}
+
+main() {
+    if [[ -n "${1+1}" ]]; then
+        OUTPUT=$1
+    fi
+
+    tempdir=temp
+    rm -rf $tempdir
+    mkdir -p $tempdir
+
+    echo "Writing results to $OUTPUT"
+    echo -n "" > $OUTPUT
+    for threads in ${THREADS[@]}; do
+        echo -ne "\t$threads" >> $OUTPUT
+    done
+    echo "" >> $OUTPUT
+
+    $CPP $CPP_FLAGS -o "$tempdir/threads" threads.cpp
+    echo -n "none" >> $OUTPUT
+    measure "$tempdir/threads"
+
+    for state in ${STATES[@]}; do
+        ./obf.sh $CPP_FLAGS $BCF_FLAGS -mllvm -opaque-state=$state\
+            -o "$tempdir/threads-$state" threads.cpp
+        echo -n "$state" >> $OUTPUT
+        measure "$tempdir/threads-$state"
+    done
+}
+
+main "$@"
@@ -0,0 +1,73 @@
+#!/bin/bash
+set -eu
+# Number of loops the loop vectorizer still manages after LoopBogusCF with
+# store based and with loop invariant opaque predicates.
+# The obfuscation schedule runs after the vectorizer, so the sorts are
+# obfuscated with opt first and optimised afterwards. LLVM 3.4 has no
+# -Rpass=loop-vectorize remarks, so the vectorizer statistics are counted
+
+OUTPUT=vectorize.txt
+SORTS=(mergesort quicksort radixsort bubblesort)
+
+LLVM_BUILD="build/Release+Asserts"
+OBF_BASE="build/projects/LLVM-Obfuscator"
+OBF_BUILD="build/projects/LLVM-Obfuscator/Release+Asserts"
+CPP="${LLVM_BUILD}/bin/clang++"
+OPT="${LLVM_BUILD}/bin/opt -load ${OBF_BUILD}/lib/LLVMObfuscatorTransforms.so"
+# Predicates stay in the loop header, where they compete with the vectorizer
+LOOP_BCF_FLAGS="-mem2reg -loop-simplify -loop-boguscf -loopBcfPlacement=header\
+    -opaque-predicate"
+
+FLAGS=(\
+    ""\
+    "-opaque-loop-invariant"\
+    "-opaque-loop-invariant -opaque-source=live"\
+    )
+
+# Print the number of loops vectorized by opt -O3 with the given passes
+vectorized() {
+    local input=$1
+    shift
+    $OPT "$@" -O3 -stats -o /dev/null "$input" 2>&1\
+        | awk '/loop-vectorize.*Number of loops vectorized/ {n = $1}
+               END {print n ? n : 0}'
+}
+
+main() {
+    if [[ -n "${1+1}" ]]; then
+        OUTPUT=$1
+    fi
+
+    (cd ${OBF_BASE} && make > /dev/null)
+
+    tempdir=temp
+    rm -rf $tempdir
+    mkdir -p $tempdir
+
+    echo "Writing results to $OUTPUT"
+    echo -n "" > $OUTPUT
+    for sort in ${SORTS[@]}; do
+        $CPP -O3 -std=c++11 -Xclang -disable-llvm-optzns -emit-llvm -c\
+            -o "$tempdir/$sort.bc" "$sort.cpp"
+        echo -ne "\t$sort" >> $OUTPUT
+    done
+    echo "" >> $OUTPUT
+
+    echo -n "none" >> $OUTPUT
+    for sort in ${SORTS[@]}; do
+        echo -ne "\t$(vectorized "$tempdir/$sort.bc")" >> $OUTPUT
+    done
+    echo "" >> $OUTPUT
+
+    for ((i = 0; i < ${#FLAGS[@]}; i++)); do
+        flags="${FLAGS[$i]}"
+        echo -n "loopbcf $flags" >> $OUTPUT
+        for sort in ${SORTS[@]}; do
+            echo -ne "\t$(vectorized "$tempdir/$sort.bc" $LOOP_BCF_FLAGS\
+                $flags)" >> $OUTPUT
+        done
+        echo "" >> $OUTPUT
+    done
+}
+
+main "$@"